@@ -0,0 +1,43 @@
+// benchmark of the vtil lifters, see vtil/bench.hpp. every result is printed as one json object per line:
+//
+//     bench [iterations] [repeat]
+//
+// the lifters are measured with the default options, with the options that change what they emit and with both
+// of those on an arena. this is the one translation unit counting allocations
+#define LIFTERS_BENCH_COUNT_ALLOCATIONS
+#include "../vtil/bench.hpp"
+
+#include <cstdlib>
+#include <iostream>
+
+int main( int argc, char **argv )
+{
+    using namespace lifters::lifter_vtil;
+
+    bench::config_t config;
+    if ( argc > 1 )
+        config.iterations = std::strtoull( argv[ 1 ], nullptr, 0 );
+    if ( argc > 2 )
+        config.repeat = std::strtoull( argv[ 2 ], nullptr, 0 );
+
+    lift_options_t optimized;
+    optimized.stack_to_temporaries = true;
+    optimized.lazy_flags = true;
+    optimized.recognize_idioms = true;
+    optimized.fold_constants = true;
+
+    bench::run_dispatch( std::cout );
+
+    for ( const auto options : { lift_options_t{}, optimized } )
+    {
+        for ( const auto arena : { false, true } )
+        {
+            auto run = config;
+            run.options = options;
+            run.arena = arena;
+            bench::run_workloads( std::cout, run );
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include <vmprofiles.hpp>
+
+#include "mnemonic.hpp"
+
+namespace lifters
+{
+    // flags_live[ idx ] is false if the flags pushed by the virtual instruction at idx are never read.
+    //
+    // vmprotect stores the flags of almost every arithmetic handler into a scratch vm register right away
+    // (sregq) and overwrites that register later without reading it, only lflagsq and friends consume them.
+    // anything that cannot be proven dead inside the code block is treated as live.
+    // flags_live is filled in place so a vector reused across blocks keeps its capacity
+    inline void flags_liveness( const vmp2::v3::code_block_t *code_blk, std::pmr::vector< bool > &flags_live )
+    {
+        const auto count = code_blk->vinstr_count;
+        flags_live.assign( count, true );
+
+        for ( auto idx = 0u; idx + 1 < count; ++idx )
+        {
+            if ( !produces_flags( get_mnemonic_info( code_blk->vinstr[ idx ].mnemonic_t ).family ) )
+                continue;
+
+            const auto &store = code_blk->vinstr[ idx + 1 ];
+            if ( store.mnemonic_t != vm::handler::SREGQ )
+                continue;
+
+            const auto flags_begin = store.operand.imm.u;
+            const auto flags_end = flags_begin + 8;
+
+            for ( auto next = idx + 2; next < count; ++next )
+            {
+                const auto &vinstr = code_blk->vinstr[ next ];
+                const auto info = get_mnemonic_info( vinstr.mnemonic_t );
+                const auto begin = vinstr.operand.imm.u;
+                const auto end = begin + info.bits / 8;
+
+                if ( info.family == family_t::lreg && begin < flags_end && flags_begin < end )
+                    break;
+
+                if ( info.family == family_t::sreg && begin <= flags_begin && flags_end <= end )
+                {
+                    flags_live[ idx ] = false;
+                    break;
+                }
+            }
+        }
+
+        // shifts only replace zf and sf, or nothing for a count of zero, and div replaces nothing, so the flags they
+        // push still hold bits of the producer before them. that one is live whenever they are
+        bool keeps_live = false;
+        for ( auto idx = count; idx--; )
+        {
+            const auto family = get_mnemonic_info( code_blk->vinstr[ idx ].mnemonic_t ).family;
+            if ( family == family_t::lflags )
+                keeps_live = false;
+
+            if ( !produces_flags( family ) )
+                continue;
+
+            if ( keeps_live )
+                flags_live[ idx ] = true;
+
+            keeps_live = flags_live[ idx ] && keeps_flags( family );
+        }
+    }
+
+    // bit n is set if the code block uses a handler of family_t n
+    inline std::uint64_t used_families( const vmp2::v3::code_block_t *code_blk )
+    {
+        std::uint64_t families = 0;
+        for ( auto idx = 0u; idx < code_blk->vinstr_count; ++idx )
+            families |= 1ull << static_cast< unsigned >( get_mnemonic_info( code_blk->vinstr[ idx ].mnemonic_t ).family );
+        return families;
+    }
+
+    // one bit per byte of the vm context
+    using context_set_t = std::bitset< 256 >;
+
+    inline context_set_t context_range( std::uint64_t context_offset, unsigned size )
+    {
+        context_set_t range;
+        for ( auto offset = context_offset; offset < context_offset + size && offset < 256; ++offset )
+            range.set( offset );
+        return range;
+    }
+
+    // the vm context bytes a code block reads before writing them (use) and the ones it writes (def)
+    struct context_summary_t
+    {
+        context_set_t use;
+        context_set_t def;
+    };
+
+    inline context_summary_t context_summary( const vmp2::v3::code_block_t *code_blk )
+    {
+        context_summary_t summary;
+        for ( auto idx = 0u; idx < code_blk->vinstr_count; ++idx )
+        {
+            const auto &vinstr = code_blk->vinstr[ idx ];
+            const auto info = get_mnemonic_info( vinstr.mnemonic_t );
+
+            if ( info.family == family_t::lreg )
+                summary.use |= context_range( vinstr.operand.imm.u, info.bits / 8 ) & ~summary.def;
+            else if ( info.family == family_t::sreg )
+                summary.def |= context_range( vinstr.operand.imm.u, info.bits / 8 );
+        }
+
+        return summary;
+    }
+
+    // which vm context bytes are live when each code block of a routine is left, found by iterating
+    // in = use | ( out & ~def ) over the successors of every block until nothing changes.
+    // a block that ends in vmexit has nothing live after it, the context is dead once the vm is left.
+    // a block whose successors are unknown or outside of the routine keeps the whole context live
+    class context_liveness_t
+    {
+      public:
+        void analyze( const std::vector< vmp2::v3::code_block_t * > &code_blks )
+        {
+            const auto count = code_blks.size();
+
+            std::unordered_map< std::uintptr_t, std::size_t > index;
+            for ( std::size_t idx = 0; idx < count; ++idx )
+                index.emplace( code_blks[ idx ]->vip_begin, idx );
+
+            struct node_t
+            {
+                context_summary_t summary;
+                context_set_t in;
+                context_set_t out;
+                std::size_t successors[ 2 ];
+                unsigned successor_count;
+                bool unknown;
+            };
+
+            std::vector< node_t > nodes( count );
+            for ( std::size_t idx = 0; idx < count; ++idx )
+            {
+                const auto code_blk = code_blks[ idx ];
+                auto &node = nodes[ idx ];
+                node.summary = context_summary( code_blk );
+                node.in = node.summary.use;
+                node.successor_count = 0;
+                node.unknown = false;
+
+                const auto &jcc = code_blk->jcc;
+                if ( !jcc.has_jcc )
+                {
+                    node.unknown = !code_blk->vinstr_count ||
+                                   code_blk->vinstr[ code_blk->vinstr_count - 1 ].mnemonic_t != vm::handler::VMEXIT;
+                    continue;
+                }
+
+                if ( jcc.type != vm::instrs::jcc_type::branching && jcc.type != vm::instrs::jcc_type::absolute )
+                {
+                    node.unknown = true;
+                    continue;
+                }
+
+                const auto targets = jcc.type == vm::instrs::jcc_type::branching ? 2u : 1u;
+                for ( auto target = 0u; target < targets; ++target )
+                {
+                    const auto found = index.find( jcc.block_addr[ target ] );
+                    if ( found == index.end() )
+                        node.unknown = true;
+                    else
+                        node.successors[ node.successor_count++ ] = found->second;
+                }
+            }
+
+            for ( bool changed = true; changed; )
+            {
+                changed = false;
+
+                // blocks are usually given in vip order, walking them backwards converges in a few passes
+                for ( auto idx = count; idx--; )
+                {
+                    auto &node = nodes[ idx ];
+
+                    context_set_t out;
+                    if ( node.unknown )
+                        out.set();
+
+                    for ( auto successor = 0u; successor < node.successor_count; ++successor )
+                        out |= nodes[ node.successors[ successor ] ].in;
+
+                    const auto in = node.summary.use | ( out & ~node.summary.def );
+                    if ( in != node.in || out != node.out )
+                    {
+                        node.in = in;
+                        node.out = out;
+                        changed = true;
+                    }
+                }
+            }
+
+            live.clear();
+            for ( std::size_t idx = 0; idx < count; ++idx )
+                live.emplace( code_blks[ idx ]->vip_begin, nodes[ idx ].out );
+        }
+
+        // nullptr if the block was not part of the analysis
+        const context_set_t *live_out( std::uintptr_t vip ) const
+        {
+            const auto found = live.find( vip );
+            return found != live.end() ? &found->second : nullptr;
+        }
+
+      private:
+        std::unordered_map< std::uintptr_t, context_set_t > live;
+    };
+
+    // bit n is set if the 8 bytes of vm context at n * 8 can be kept in a temporary for the whole block: the block
+    // overwrites all of them before reading any, and none are live when it is left
+    inline std::uint32_t coalescible_granules( const vmp2::v3::code_block_t *code_blk, const context_set_t &live_out )
+    {
+        std::uint32_t seen = 0, coalescible = 0;
+
+        for ( auto idx = 0u; idx < code_blk->vinstr_count; ++idx )
+        {
+            const auto &vinstr = code_blk->vinstr[ idx ];
+            const auto info = get_mnemonic_info( vinstr.mnemonic_t );
+            if ( info.family != family_t::lreg && info.family != family_t::sreg )
+                continue;
+
+            const auto granule = static_cast< unsigned >( vinstr.operand.imm.u / 8 ) & 31;
+            if ( seen & ( 1u << granule ) )
+                continue;
+
+            seen |= 1u << granule;
+            if ( info.family == family_t::sreg && info.bits == 64 && !( vinstr.operand.imm.u & 7 ) &&
+                 ( live_out & context_range( granule * 8, 8 ) ).none() )
+                coalescible |= 1u << granule;
+        }
+
+        return coalescible;
+    }
+} // namespace lifters
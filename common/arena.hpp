@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+namespace lifters
+{
+    // bump allocator for everything the lifters allocate while lifting a routine. nothing is freed until reset(),
+    // which drops every allocation at once and keeps the first chunk around for the next routine.
+    // reset() must only be called once everything allocating from the arena is gone: a lift_context_t that outlives
+    // it would keep writing to its released memory. debug builds assert that every allocation was given back.
+    // not thread safe, give every thread its own
+    class arena_t : public std::pmr::memory_resource
+    {
+      public:
+        explicit arena_t( std::size_t initial_size = 64 * 1024 )
+            : initial( std::make_unique< std::byte[] >( initial_size ) ), initial_size( initial_size ),
+              resource( initial.get(), initial_size, std::pmr::new_delete_resource() )
+        {
+        }
+
+        arena_t( const arena_t & ) = delete;
+        arena_t &operator=( const arena_t & ) = delete;
+
+        void reset()
+        {
+            assert( outstanding == 0 && "arena_t reset while its memory is still in use" );
+            resource.release();
+            outstanding = 0;
+            allocations = 0;
+            bytes = 0;
+        }
+
+        std::size_t allocation_count() const
+        {
+            return allocations;
+        }
+
+        std::size_t bytes_allocated() const
+        {
+            return bytes;
+        }
+
+      private:
+        void *do_allocate( std::size_t size, std::size_t alignment ) override
+        {
+            ++allocations;
+            ++outstanding;
+            bytes += size;
+            return resource.allocate( size, alignment );
+        }
+
+        // the memory is only reclaimed by reset(), deallocations are only counted for its check
+        void do_deallocate( void *, std::size_t, std::size_t ) override
+        {
+            --outstanding;
+        }
+
+        bool do_is_equal( const std::pmr::memory_resource &other ) const noexcept override
+        {
+            return this == &other;
+        }
+
+        std::unique_ptr< std::byte[] > initial;
+        std::size_t initial_size;
+        std::pmr::monotonic_buffer_resource resource;
+
+        std::size_t allocations = 0;
+        std::size_t outstanding = 0;
+        std::size_t bytes = 0;
+    };
+} // namespace lifters
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include <vmprofiles.hpp>
+
+#if defined( __AVX2__ )
+#include <immintrin.h>
+#endif
+
+namespace lifters
+{
+    // fingerprints of virtual instruction sequences, for cache keys and for finding blocks or parts of blocks that
+    // repeat across a binary.
+    //
+    // every virtual instruction is packed into packed_words 32 bit words: the mnemonic, has_imm and imm_size in the
+    // first, the immediate in the other two. the packed words are hashed in 8 independent xxhash32 style lanes,
+    // with AVX2 all of them are updated by one instruction. the scalar version computes the exact same lanes, so
+    // fingerprints do not depend on how the lifters were built
+    namespace fingerprint
+    {
+        constexpr std::size_t packed_words = 3;
+        constexpr std::size_t lane_count = 8;
+
+        constexpr std::uint32_t prime32_1 = 0x9e3779b1u;
+        constexpr std::uint32_t prime32_2 = 0x85ebca77u;
+        constexpr std::uint32_t prime32_3 = 0xc2b2ae3du;
+        constexpr std::uint64_t prime64_1 = 0x9e3779b185ebca87ull;
+        constexpr std::uint64_t prime64_2 = 0xc2b2ae3d27d4eb4full;
+
+        inline void pack( const vm::instrs::virt_instr_t &vinstr, std::uint32_t *out )
+        {
+            const auto imm = vinstr.operand.has_imm ? static_cast< std::uint64_t >( vinstr.operand.imm.u ) : 0ull;
+
+            out[ 0 ] = static_cast< std::uint32_t >( static_cast< std::uint16_t >( vinstr.mnemonic_t ) ) |
+                       static_cast< std::uint32_t >( vinstr.operand.has_imm ? 1u : 0u ) << 16 |
+                       static_cast< std::uint32_t >( static_cast< std::uint8_t >( vinstr.operand.imm.imm_size ) ) << 24;
+            out[ 1 ] = static_cast< std::uint32_t >( imm );
+            out[ 2 ] = static_cast< std::uint32_t >( imm >> 32 );
+        }
+
+        // appends the packed words of every virtual instruction of the code block
+        inline void pack( const vmp2::v3::code_block_t *code_blk, std::vector< std::uint32_t > &out )
+        {
+            const auto offset = out.size();
+            out.resize( offset + code_blk->vinstr_count * packed_words );
+            for ( auto idx = 0u; idx < code_blk->vinstr_count; ++idx )
+                pack( code_blk->vinstr[ idx ], out.data() + offset + idx * packed_words );
+        }
+
+        namespace detail
+        {
+            constexpr std::uint32_t rotl32( std::uint32_t value, unsigned count )
+            {
+                return value << count | value >> ( 32 - count );
+            }
+
+            constexpr std::uint64_t rotl64( std::uint64_t value, unsigned count )
+            {
+                return value << count | value >> ( 64 - count );
+            }
+
+            inline void accumulate_scalar( std::uint32_t *lanes, const std::uint32_t *words, std::size_t stripes )
+            {
+                for ( std::size_t stripe = 0; stripe < stripes; ++stripe, words += lane_count )
+                    for ( std::size_t lane = 0; lane < lane_count; ++lane )
+                        lanes[ lane ] = rotl32( lanes[ lane ] + words[ lane ] * prime32_2, 13 ) * prime32_1;
+            }
+
+#if defined( __AVX2__ )
+            inline void accumulate_avx2( std::uint32_t *lanes, const std::uint32_t *words, std::size_t stripes )
+            {
+                const auto p1 = _mm256_set1_epi32( static_cast< int >( prime32_1 ) );
+                const auto p2 = _mm256_set1_epi32( static_cast< int >( prime32_2 ) );
+
+                auto acc = _mm256_loadu_si256( reinterpret_cast< const __m256i * >( lanes ) );
+                for ( std::size_t stripe = 0; stripe < stripes; ++stripe, words += lane_count )
+                {
+                    const auto input = _mm256_loadu_si256( reinterpret_cast< const __m256i * >( words ) );
+                    acc = _mm256_add_epi32( acc, _mm256_mullo_epi32( input, p2 ) );
+                    acc = _mm256_or_si256( _mm256_slli_epi32( acc, 13 ), _mm256_srli_epi32( acc, 19 ) );
+                    acc = _mm256_mullo_epi32( acc, p1 );
+                }
+                _mm256_storeu_si256( reinterpret_cast< __m256i * >( lanes ), acc );
+            }
+#endif
+
+            // the lanes are merged and the words that do not fill a stripe are mixed in one at a time
+            inline std::uint64_t finalize( const std::uint32_t *lanes, const std::uint32_t *tail, std::size_t tail_count,
+                                           std::size_t count, std::uint64_t seed )
+            {
+                auto hash = seed ^ static_cast< std::uint64_t >( count ) * prime64_1;
+                for ( std::size_t lane = 0; lane < lane_count; ++lane )
+                    hash = rotl64( hash ^ lanes[ lane ] * prime64_2, 27 ) * prime64_1;
+
+                for ( std::size_t idx = 0; idx < tail_count; ++idx )
+                    hash = rotl64( hash ^ tail[ idx ] * prime64_1, 31 ) * prime64_2;
+
+                hash ^= hash >> 33;
+                hash *= 0xff51afd7ed558ccdull;
+                hash ^= hash >> 33;
+                hash *= 0xc4ceb9fe1a85ec53ull;
+                hash ^= hash >> 33;
+                return hash;
+            }
+
+            inline void init( std::uint32_t *lanes, std::uint64_t seed )
+            {
+                for ( std::size_t lane = 0; lane < lane_count; ++lane )
+                    lanes[ lane ] = static_cast< std::uint32_t >( seed ^ seed >> 32 ) + prime32_3 * ( lane + 1 );
+            }
+        } // namespace detail
+
+        // same result as hash() on every build, for checking the vectorized version against
+        inline std::uint64_t hash_scalar( const std::uint32_t *words, std::size_t count, std::uint64_t seed = 0 )
+        {
+            std::uint32_t lanes[ lane_count ];
+            detail::init( lanes, seed );
+
+            const auto stripes = count / lane_count;
+            detail::accumulate_scalar( lanes, words, stripes );
+            return detail::finalize( lanes, words + stripes * lane_count, count % lane_count, count, seed );
+        }
+
+        inline std::uint64_t hash( const std::uint32_t *words, std::size_t count, std::uint64_t seed = 0 )
+        {
+#if defined( __AVX2__ )
+            std::uint32_t lanes[ lane_count ];
+            detail::init( lanes, seed );
+
+            const auto stripes = count / lane_count;
+            detail::accumulate_avx2( lanes, words, stripes );
+            return detail::finalize( lanes, words + stripes * lane_count, count % lane_count, count, seed );
+#else
+            return hash_scalar( words, count, seed );
+#endif
+        }
+
+        inline std::uint64_t hash( const vmp2::v3::code_block_t *code_blk, std::uint64_t seed = 0 )
+        {
+            std::vector< std::uint32_t > words;
+            pack( code_blk, words );
+            return hash( words.data(), words.size(), seed );
+        }
+
+        // one 64 bit token per packed virtual instruction, the alphabet of the rolling hash
+        inline std::uint64_t token( const std::uint32_t *packed )
+        {
+            const auto imm = static_cast< std::uint64_t >( packed[ 2 ] ) << 32 | packed[ 1 ];
+            return detail::rotl64( ( packed[ 0 ] * prime64_1 ) ^ imm, 31 ) * prime64_2;
+        }
+
+        // rabin-karp hash of every window of length virtual instructions, out[ idx ] covers instructions idx to
+        // idx + length - 1. arithmetic is modulo 2^64, equal hashes still have to be compared
+        inline void rolling_hashes( const std::uint32_t *words, std::size_t vinstr_count, std::size_t length,
+                                    std::vector< std::uint64_t > &out )
+        {
+            constexpr std::uint64_t base = 0x100000001b3ull;
+
+            out.clear();
+            if ( !length || vinstr_count < length )
+                return;
+
+            std::uint64_t leading = 1; // base ^ ( length - 1 ), the weight of the instruction leaving the window
+            for ( std::size_t idx = 1; idx < length; ++idx )
+                leading *= base;
+
+            std::uint64_t hash = 0;
+            for ( std::size_t idx = 0; idx < length; ++idx )
+                hash = hash * base + token( words + idx * packed_words );
+
+            out.reserve( vinstr_count - length + 1 );
+            out.push_back( hash );
+
+            for ( std::size_t idx = length; idx < vinstr_count; ++idx )
+            {
+                hash -= token( words + ( idx - length ) * packed_words ) * leading;
+                hash = hash * base + token( words + idx * packed_words );
+                out.push_back( hash );
+            }
+        }
+
+        struct occurrence_t
+        {
+            std::size_t block;
+            std::size_t index;
+        };
+
+        // a sequence of virtual instructions found more than once
+        struct repeat_t
+        {
+            std::uint64_t hash;
+            std::size_t length;
+            std::vector< occurrence_t > occurrences;
+        };
+
+        // every sequence of length virtual instructions that occurs at least twice in the code blocks, the ones
+        // occurring most often first. occurrences of a sequence inside the same block do not overlap
+        inline std::vector< repeat_t > find_repeats( const std::vector< vmp2::v3::code_block_t * > &code_blks,
+                                                     std::size_t length )
+        {
+            std::vector< std::vector< std::uint32_t > > packed( code_blks.size() );
+            for ( std::size_t block = 0; block < code_blks.size(); ++block )
+                pack( code_blks[ block ], packed[ block ] );
+
+            const auto same = [ & ]( const occurrence_t &a, const occurrence_t &b )
+            {
+                return !std::memcmp( packed[ a.block ].data() + a.index * packed_words,
+                                     packed[ b.block ].data() + b.index * packed_words,
+                                     length * packed_words * sizeof( std::uint32_t ) );
+            };
+
+            // colliding sequences share a hash but end up in repeats of their own
+            std::vector< repeat_t > repeats;
+            std::unordered_multimap< std::uint64_t, std::size_t > by_hash;
+            std::vector< std::uint64_t > hashes;
+
+            for ( std::size_t block = 0; block < code_blks.size(); ++block )
+            {
+                rolling_hashes( packed[ block ].data(), code_blks[ block ]->vinstr_count, length, hashes );
+
+                for ( std::size_t index = 0; index < hashes.size(); ++index )
+                {
+                    const occurrence_t occurrence = { block, index };
+
+                    auto range = by_hash.equal_range( hashes[ index ] );
+                    auto it = std::find_if( range.first, range.second, [ & ]( const auto &entry )
+                                            { return same( repeats[ entry.second ].occurrences.front(), occurrence ); } );
+
+                    if ( it == range.second )
+                    {
+                        by_hash.emplace( hashes[ index ], repeats.size() );
+                        repeats.push_back( { hashes[ index ], length, { occurrence } } );
+                        continue;
+                    }
+
+                    auto &occurrences = repeats[ it->second ].occurrences;
+                    const auto &last = occurrences.back();
+                    if ( last.block != block || last.index + length <= index )
+                        occurrences.push_back( occurrence );
+                }
+            }
+
+            repeats.erase( std::remove_if( repeats.begin(), repeats.end(),
+                                           []( const repeat_t &repeat ) { return repeat.occurrences.size() < 2; } ),
+                           repeats.end() );
+
+            std::stable_sort( repeats.begin(), repeats.end(), []( const repeat_t &a, const repeat_t &b )
+                              { return a.occurrences.size() > b.occurrences.size(); } );
+            return repeats;
+        }
+    } // namespace fingerprint
+} // namespace lifters
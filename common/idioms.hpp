@@ -0,0 +1,212 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vmprofiles.hpp>
+
+#include "mnemonic.hpp"
+
+namespace lifters
+{
+    // vmprotect builds not/and/or/xor/sub out of nand and add handlers, these are the canonical sequences:
+    //
+    //   not a   := nand( a, a )
+    //   and a b := nand( not a, not b )
+    //   or a b  := not nand( a, b )
+    //   xor a b := nand( nand( a, b ), and a b )
+    //   sub a b := not ( not a + b )
+    //
+    // the flags pushed by every intermediate nand/add are stored into a scratch vm register with sregq, the
+    // flags of the last handler are left on the stack. a value is duplicated with pushvspq followed by a read
+    enum class idiom_t : std::uint8_t
+    {
+        none,
+        not_,
+        and_,
+        or_,
+        xor_,
+        sub,
+    };
+
+    // an operand of an idiom, either an lreg of the vm context or an lconst immediate
+    struct idiom_source_t
+    {
+        bool is_imm;
+        std::uint64_t value;
+
+        bool operator==( const idiom_source_t &other ) const
+        {
+            return is_imm == other.is_imm && value == other.value;
+        }
+    };
+
+    struct idiom_flag_store_t
+    {
+        // index of the handler that produced the flags, the sregq follows it
+        std::size_t producer;
+        std::uint8_t context_offset;
+    };
+
+    struct idiom_match_t
+    {
+        idiom_t kind = idiom_t::none;
+        std::uint8_t bits = 0;
+
+        // the virtual instructions the idiom replaces, [ index, index + length )
+        std::size_t index = 0;
+        std::size_t length = 0;
+
+        idiom_source_t a = {}, b = {};
+
+        std::array< idiom_flag_store_t, 4 > flag_stores = {};
+        std::size_t flag_store_count = 0;
+    };
+
+    namespace idioms
+    {
+        enum class token_t : std::uint8_t
+        {
+            end,
+            ld_a,  // lreg/lconst of the first operand
+            ld_b,  // lreg/lconst of the second operand
+            nand,  // nand of the idiom width
+            add,   // add of the idiom width
+            flags, // sregq of the flags pushed by the previous handler
+            dup,   // pushvspq, read of the idiom width
+        };
+
+        struct pattern_t
+        {
+            idiom_t kind;
+            std::array< token_t, 16 > tokens;
+        };
+
+        using t = token_t;
+
+        // longest patterns first, not is a prefix of and/sub
+        constexpr pattern_t patterns[] = {
+            { idiom_t::xor_,
+              { t::ld_a, t::ld_b, t::nand, t::flags, t::ld_a, t::ld_a, t::nand, t::flags, t::ld_b, t::ld_b, t::nand,
+                t::flags, t::nand, t::flags, t::nand } },
+            { idiom_t::and_, { t::ld_a, t::ld_a, t::nand, t::flags, t::ld_b, t::ld_b, t::nand, t::flags, t::nand } },
+            { idiom_t::sub, { t::ld_a, t::ld_a, t::nand, t::flags, t::ld_b, t::add, t::flags, t::dup, t::nand } },
+            { idiom_t::or_, { t::ld_a, t::ld_b, t::nand, t::flags, t::dup, t::nand } },
+            { idiom_t::not_, { t::ld_a, t::ld_a, t::nand } },
+            { idiom_t::not_, { t::ld_a, t::dup, t::nand } },
+        };
+
+        inline bool match_source( const vm::instrs::virt_instr_t &vinstr, std::uint8_t &bits, idiom_source_t &source,
+                                  bool &bound )
+        {
+            const auto info = get_mnemonic_info( vinstr.mnemonic_t );
+            if ( info.family != family_t::lreg && info.family != family_t::lconst )
+                return false;
+
+            // the sign/zero extending lconst variants do not load a value of their own width
+            if ( info.family == family_t::lconst && vinstr.mnemonic_t != vm::handler::LCONSTQ &&
+                 vinstr.mnemonic_t != vm::handler::LCONSTDW && vinstr.mnemonic_t != vm::handler::LCONSTW )
+                return false;
+
+            if ( bits && info.bits != bits )
+                return false;
+
+            const idiom_source_t loaded = { info.family == family_t::lconst, vinstr.operand.imm.u };
+            if ( bound && !( loaded == source ) )
+                return false;
+
+            bits = info.bits;
+            source = loaded;
+            bound = true;
+            return true;
+        }
+
+        inline bool overlaps( const idiom_source_t &source, std::uint8_t bits, std::uint8_t context_offset )
+        {
+            return !source.is_imm && source.value < context_offset + 8u && context_offset < source.value + bits / 8u;
+        }
+
+        inline idiom_match_t match( const vmp2::v3::code_block_t *code_blk, std::size_t idx, const pattern_t &pattern )
+        {
+            idiom_match_t result;
+            bool a_bound = false, b_bound = false;
+            auto pos = idx;
+
+            const auto next = [ & ]() -> const vm::instrs::virt_instr_t * {
+                return pos < code_blk->vinstr_count ? &code_blk->vinstr[ pos++ ] : nullptr;
+            };
+
+            for ( const auto token : pattern.tokens )
+            {
+                if ( token == t::end )
+                    break;
+
+                const auto vinstr = next();
+                if ( !vinstr )
+                    return {};
+
+                const auto info = get_mnemonic_info( vinstr->mnemonic_t );
+                switch ( token )
+                {
+                case t::ld_a:
+                    if ( !match_source( *vinstr, result.bits, result.a, a_bound ) )
+                        return {};
+                    break;
+                case t::ld_b:
+                    if ( !match_source( *vinstr, result.bits, result.b, b_bound ) )
+                        return {};
+                    break;
+                case t::nand:
+                case t::add:
+                    if ( info.family != ( token == t::nand ? family_t::nand : family_t::add ) ||
+                         info.bits != result.bits )
+                        return {};
+                    break;
+                case t::flags:
+                    if ( vinstr->mnemonic_t != vm::handler::SREGQ ||
+                         result.flag_store_count == result.flag_stores.size() )
+                        return {};
+                    result.flag_stores[ result.flag_store_count++ ] = {
+                        pos - 2, static_cast< std::uint8_t >( vinstr->operand.imm.u ) };
+                    break;
+                case t::dup:
+                {
+                    const auto read = next();
+                    if ( info.family != family_t::pushvsp || !read )
+                        return {};
+
+                    const auto read_info = get_mnemonic_info( read->mnemonic_t );
+                    if ( read_info.family != family_t::read || read_info.bits != result.bits )
+                        return {};
+                    break;
+                }
+                default:
+                    return {};
+                }
+            }
+
+            // the operands are read before the intermediate flags are stored when the idiom is lifted
+            for ( auto store = 0u; store < result.flag_store_count; ++store )
+            {
+                const auto offset = result.flag_stores[ store ].context_offset;
+                if ( overlaps( result.a, result.bits, offset ) || ( b_bound && overlaps( result.b, result.bits, offset ) ) )
+                    return {};
+            }
+
+            result.kind = pattern.kind;
+            result.index = idx;
+            result.length = pos - idx;
+            return result;
+        }
+    } // namespace idioms
+
+    // tries every idiom at code_blk->vinstr[ idx ], kind is idiom_t::none if nothing matched
+    inline idiom_match_t match_idiom( const vmp2::v3::code_block_t *code_blk, std::size_t idx )
+    {
+        for ( const auto &pattern : idioms::patterns )
+            if ( auto result = idioms::match( code_blk, idx, pattern ); result.kind != idiom_t::none )
+                return result;
+
+        return {};
+    }
+} // namespace lifters
@@ -0,0 +1,322 @@
+#pragma once
+
+// lift phase instrumentation, everything in here is compiled out unless LIFTERS_INSTRUMENTATION is defined.
+//
+// per mnemonic counters (invocations, time spent in the lifter, instructions emitted, mnemonics without a lifter)
+// and per block totals (blocks, virtual instructions, instructions emitted) are kept in relaxed atomics.
+// with stack_to_temporaries the pushes of a handler are only emitted when a later handler or the end of the block
+// flushes them, so per mnemonic emitted counts are inexact: they charge flushed values to the handler that
+// flushed them and miss the flush at the end of the block. the block totals count every instruction.
+// with recognize_idioms every handler an idiom replaces is counted once, the time and the instructions emitted for
+// the idiom are charged to its last handler.
+//
+// spans (one per code block and per phase: decode, lift, optimize) are appended to a buffer owned by the thread
+// that recorded them and can be exported as chrome trace json (chrome://tracing, perfetto). export once the
+// lifting threads are done, the buffers are not locked while they are written
+
+#ifdef LIFTERS_INSTRUMENTATION
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <vmprofiles.hpp>
+
+namespace lifters
+{
+    namespace instrumentation
+    {
+        inline std::uint64_t now_ns()
+        {
+            return std::chrono::duration_cast< std::chrono::nanoseconds >(
+                       std::chrono::steady_clock::now().time_since_epoch() )
+                .count();
+        }
+
+        class profiler_t
+        {
+          public:
+            // mnemonics past this are counted in the last slot
+            static constexpr std::size_t max_mnemonics = 256;
+
+            static profiler_t &get()
+            {
+                static profiler_t profiler;
+                return profiler;
+            }
+
+            void record_handler( vm::handler::mnemonic_t mnemonic, std::uint64_t ns, std::size_t emitted )
+            {
+                auto &counter = handlers[ slot( mnemonic ) ];
+                counter.count.fetch_add( 1, std::memory_order_relaxed );
+                counter.ns.fetch_add( ns, std::memory_order_relaxed );
+                counter.emitted.fetch_add( emitted, std::memory_order_relaxed );
+            }
+
+            void record_block( std::size_t vinstrs, std::size_t emitted )
+            {
+                blocks.count.fetch_add( 1, std::memory_order_relaxed );
+                blocks.vinstrs.fetch_add( vinstrs, std::memory_order_relaxed );
+                blocks.emitted.fetch_add( emitted, std::memory_order_relaxed );
+            }
+
+            void record_missing( vm::handler::mnemonic_t mnemonic )
+            {
+                missing[ slot( mnemonic ) ].fetch_add( 1, std::memory_order_relaxed );
+            }
+
+            void record_span( const char *name, const char *category, std::uint64_t begin_ns, std::uint64_t end_ns,
+                              std::uint64_t arg )
+            {
+                thread_buffer().spans.push_back( { name, category, begin_ns, end_ns, arg } );
+            }
+
+            // {"blocks":{"count":..,"vinstrs":..,"emitted":..},
+            //  "handlers":[{"mnemonic":..,"count":..,"ns":..,"emitted":..}],"missing":[{"mnemonic":..,"count":..}]}
+            void write_summary( std::ostream &out ) const
+            {
+                out << "{\"blocks\":{\"count\":" << blocks.count.load( std::memory_order_relaxed )
+                    << ",\"vinstrs\":" << blocks.vinstrs.load( std::memory_order_relaxed )
+                    << ",\"emitted\":" << blocks.emitted.load( std::memory_order_relaxed ) << "},\"handlers\":[";
+                bool first = true;
+                for ( std::size_t idx = 0; idx < max_mnemonics; ++idx )
+                {
+                    const auto count = handlers[ idx ].count.load( std::memory_order_relaxed );
+                    if ( !count )
+                        continue;
+
+                    out << ( first ? "" : "," ) << "{\"mnemonic\":" << idx << ",\"count\":" << count
+                        << ",\"ns\":" << handlers[ idx ].ns.load( std::memory_order_relaxed )
+                        << ",\"emitted\":" << handlers[ idx ].emitted.load( std::memory_order_relaxed ) << "}";
+                    first = false;
+                }
+
+                out << "],\"missing\":[";
+                first = true;
+                for ( std::size_t idx = 0; idx < max_mnemonics; ++idx )
+                {
+                    const auto count = missing[ idx ].load( std::memory_order_relaxed );
+                    if ( !count )
+                        continue;
+
+                    out << ( first ? "" : "," ) << "{\"mnemonic\":" << idx << ",\"count\":" << count << "}";
+                    first = false;
+                }
+                out << "]}\n";
+            }
+
+            void write_chrome_trace( std::ostream &out ) const
+            {
+                std::lock_guard lock( mutex );
+
+                out << "{\"traceEvents\":[";
+                bool first = true;
+                for ( const auto &buffer : buffers )
+                {
+                    for ( const auto &span : buffer->spans )
+                    {
+                        out << ( first ? "" : ",\n" ) << "{\"name\":\"" << span.name << "\",\"cat\":\"" << span.category
+                            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread_index << ",\"ts\":";
+                        write_microseconds( out, span.begin_ns );
+                        out << ",\"dur\":";
+                        write_microseconds( out, span.end_ns - span.begin_ns );
+                        out << ",\"args\":{\"arg\":" << span.arg << "}}";
+                        first = false;
+                    }
+                }
+                out << "]}\n";
+            }
+
+            void reset()
+            {
+                for ( auto &counter : handlers )
+                {
+                    counter.count = 0;
+                    counter.ns = 0;
+                    counter.emitted = 0;
+                }
+
+                for ( auto &counter : missing )
+                    counter = 0;
+
+                blocks.count = 0;
+                blocks.vinstrs = 0;
+                blocks.emitted = 0;
+
+                std::lock_guard lock( mutex );
+                for ( auto &buffer : buffers )
+                    buffer->spans.clear();
+            }
+
+          private:
+            struct handler_counter_t
+            {
+                std::atomic< std::uint64_t > count = 0;
+                std::atomic< std::uint64_t > ns = 0;
+                std::atomic< std::uint64_t > emitted = 0;
+            };
+
+            struct block_counter_t
+            {
+                std::atomic< std::uint64_t > count = 0;
+                std::atomic< std::uint64_t > vinstrs = 0;
+                std::atomic< std::uint64_t > emitted = 0;
+            };
+
+            struct span_record_t
+            {
+                const char *name;
+                const char *category;
+                std::uint64_t begin_ns;
+                std::uint64_t end_ns;
+                std::uint64_t arg;
+            };
+
+            struct thread_buffer_t
+            {
+                std::size_t thread_index;
+                std::vector< span_record_t > spans;
+            };
+
+            // chrome traces are in microseconds, printed as fixed point so timestamps keep their precision
+            static void write_microseconds( std::ostream &out, std::uint64_t ns )
+            {
+                char text[ 32 ];
+                std::snprintf( text, sizeof( text ), "%llu.%03u", static_cast< unsigned long long >( ns / 1000 ),
+                               static_cast< unsigned >( ns % 1000 ) );
+                out << text;
+            }
+
+            static std::size_t slot( vm::handler::mnemonic_t mnemonic )
+            {
+                return std::min< std::size_t >( static_cast< std::size_t >( mnemonic ), max_mnemonics - 1 );
+            }
+
+            thread_buffer_t &thread_buffer()
+            {
+                thread_local thread_buffer_t *buffer = nullptr;
+                if ( !buffer )
+                {
+                    std::lock_guard lock( mutex );
+                    buffers.push_back( std::make_unique< thread_buffer_t >() );
+                    buffers.back()->thread_index = buffers.size();
+                    buffer = buffers.back().get();
+                }
+
+                return *buffer;
+            }
+
+            std::array< handler_counter_t, max_mnemonics > handlers;
+            std::array< std::atomic< std::uint64_t >, max_mnemonics > missing = {};
+            block_counter_t blocks;
+
+            mutable std::mutex mutex;
+            std::vector< std::unique_ptr< thread_buffer_t > > buffers;
+        };
+
+        // records a span from construction to destruction
+        class span_t
+        {
+          public:
+            span_t( const char *name, const char *category, std::uint64_t arg = 0 )
+                : name( name ), category( category ), arg( arg ), begin_ns( now_ns() )
+            {
+            }
+
+            ~span_t()
+            {
+                profiler_t::get().record_span( name, category, begin_ns, now_ns(), arg );
+            }
+
+          private:
+            const char *name;
+            const char *category;
+            std::uint64_t arg;
+            std::uint64_t begin_ns;
+        };
+
+        // times a single handler lifter, emitted is the size of the output before and after it ran. values it
+        // leaves in temporaries are not part of it, see the note at the top
+        class handler_timer_t
+        {
+          public:
+            handler_timer_t( vm::handler::mnemonic_t mnemonic, std::size_t size_before )
+                : mnemonic( mnemonic ), size_before( size_before ), begin_ns( now_ns() )
+            {
+            }
+
+            void stop( std::size_t size_after )
+            {
+                profiler_t::get().record_handler( mnemonic, now_ns() - begin_ns, size_after - size_before );
+            }
+
+          private:
+            vm::handler::mnemonic_t mnemonic;
+            std::size_t size_before;
+            std::uint64_t begin_ns;
+        };
+
+        // times an idiom lifted in place of the handlers [ index, index + length ) of code_blk, see the note at the
+        // top
+        class idiom_timer_t
+        {
+          public:
+            explicit idiom_timer_t( std::size_t size_before ) : size_before( size_before ), begin_ns( now_ns() )
+            {
+            }
+
+            void stop( const vmp2::v3::code_block_t *code_blk, std::size_t index, std::size_t length,
+                       std::size_t size_after )
+            {
+                const auto ns = now_ns() - begin_ns;
+                for ( auto idx = index; idx < index + length; ++idx )
+                {
+                    const auto last = idx + 1 == index + length;
+                    profiler_t::get().record_handler( code_blk->vinstr[ idx ].mnemonic_t, last ? ns : 0,
+                                                      last ? size_after - size_before : 0 );
+                }
+            }
+
+          private:
+            std::size_t size_before;
+            std::uint64_t begin_ns;
+        };
+
+        // counts a lifted block when it goes out of scope, after the driver flushed the temporaries into blk
+        template < typename block_t > class block_recorder_t
+        {
+          public:
+            block_recorder_t( const block_t *blk, std::size_t vinstrs )
+                : blk( blk ), vinstrs( vinstrs ), size_before( blk->size() )
+            {
+            }
+
+            ~block_recorder_t()
+            {
+                profiler_t::get().record_block( vinstrs, blk->size() - size_before );
+            }
+
+          private:
+            const block_t *blk;
+            std::size_t vinstrs;
+            std::size_t size_before;
+        };
+    } // namespace instrumentation
+} // namespace lifters
+
+#define LIFTERS_CONCAT_( a, b ) a##b
+#define LIFTERS_CONCAT( a, b ) LIFTERS_CONCAT_( a, b )
+#define LIFTERS_SPAN( name, category, arg )                                                                            \
+    ::lifters::instrumentation::span_t LIFTERS_CONCAT( lifters_span_, __LINE__ )( name, category, arg )
+
+#else
+
+#define LIFTERS_SPAN( name, category, arg ) ( ( void )0 )
+
+#endif
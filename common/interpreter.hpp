@@ -0,0 +1,630 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <vmprofiles.hpp>
+
+#include "mnemonic.hpp"
+
+// executes virtual instructions directly, as an oracle for the lifters. the semantics are those of the native
+// vmprotect handlers the lifters describe, with the stack layout the lifters use: every value takes its own width
+// on the virtual stack, bytes take a word. the flags the handlers push are only modeled with
+// machine_t::compute_flags, see there
+
+namespace lifters
+{
+    namespace interpreter
+    {
+        // sparse byte addressable memory in 4kb pages, unmapped memory reads as zero
+        class memory_t
+        {
+          public:
+            static constexpr std::uint64_t page_size = 0x1000;
+
+            using page_t = std::array< std::uint8_t, page_size >;
+
+            memory_t() = default;
+
+            memory_t( const memory_t &other )
+            {
+                *this = other;
+            }
+
+            memory_t &operator=( const memory_t &other )
+            {
+                if ( this == &other )
+                    return *this;
+
+                clear();
+                for ( const auto &[ index, page ] : other.pages )
+                    pages.emplace( index, std::make_unique< page_t >( *page ) );
+                return *this;
+            }
+
+            std::uint64_t read( std::uint64_t address, unsigned size ) const
+            {
+                std::uint64_t value = 0;
+                if ( address % page_size + size <= page_size )
+                {
+                    if ( const auto page = find( address / page_size ) )
+                        std::memcpy( &value, page->data() + address % page_size, size );
+                    return value;
+                }
+
+                for ( auto idx = 0u; idx < size; ++idx )
+                {
+                    const auto page = find( ( address + idx ) / page_size );
+                    const auto byte = page ? ( *page )[ ( address + idx ) % page_size ] : 0;
+                    value |= static_cast< std::uint64_t >( byte ) << ( idx * 8 );
+                }
+                return value;
+            }
+
+            void write( std::uint64_t address, std::uint64_t value, unsigned size )
+            {
+                if ( address % page_size + size <= page_size )
+                {
+                    std::memcpy( map( address / page_size )->data() + address % page_size, &value, size );
+                    return;
+                }
+
+                for ( auto idx = 0u; idx < size; ++idx )
+                    ( *map( ( address + idx ) / page_size ) )[ ( address + idx ) % page_size ] =
+                        static_cast< std::uint8_t >( value >> ( idx * 8 ) );
+            }
+
+            void clear()
+            {
+                pages.clear();
+                last_index = ~0ull;
+                last_page = nullptr;
+            }
+
+            const std::unordered_map< std::uint64_t, std::unique_ptr< page_t > > &mapped() const
+            {
+                return pages;
+            }
+
+            // bytes that are not mapped on one side compare as zero
+            bool operator==( const memory_t &other ) const
+            {
+                return contains( other ) && other.contains( *this );
+            }
+
+          private:
+            bool contains( const memory_t &other ) const
+            {
+                static const page_t zero = {};
+                for ( const auto &[ index, page ] : other.pages )
+                {
+                    const auto mine = find( index );
+                    if ( std::memcmp( mine ? mine->data() : zero.data(), page->data(), page_size ) )
+                        return false;
+                }
+                return true;
+            }
+
+            const page_t *find( std::uint64_t index ) const
+            {
+                if ( index == last_index )
+                    return last_page;
+
+                const auto found = pages.find( index );
+                if ( found == pages.end() )
+                    return nullptr;
+
+                last_index = index;
+                last_page = found->second.get();
+                return last_page;
+            }
+
+            page_t *map( std::uint64_t index )
+            {
+                if ( index == last_index && last_page )
+                    return last_page;
+
+                auto &page = pages[ index ];
+                if ( !page )
+                    page = std::make_unique< page_t >();
+
+                last_index = index;
+                last_page = page.get();
+                return last_page;
+            }
+
+            std::unordered_map< std::uint64_t, std::unique_ptr< page_t > > pages;
+            mutable std::uint64_t last_index = ~0ull;
+            mutable page_t *last_page = nullptr;
+        };
+
+        // everything a code block can observe or change. the virtual stack lives in memory at vsp
+        struct machine_t
+        {
+            std::array< std::uint8_t, 256 > context = {};
+            memory_t memory;
+            std::uint64_t vsp = 0x10000;
+            std::uint64_t rflags = 0x202;
+            std::uint64_t tsc = 0;
+
+            // the handlers compute zf, sf, cf and of into rflags before pushing it, the flags lazy_flags materializes.
+            // pf and af, cf and of of shifts and every flag of div are not modeled and keep their value, a shift by
+            // zero keeps all of them. off, rflags is pushed as it is like the lifters do without lazy_flags
+            bool compute_flags = false;
+
+            std::uint64_t read_context( std::uint64_t offset, unsigned size ) const
+            {
+                std::uint64_t value = 0;
+                std::memcpy( &value, context.data() + ( offset & 0xff ), std::min< std::uint64_t >( size, 256 - ( offset & 0xff ) ) );
+                return value;
+            }
+
+            void write_context( std::uint64_t offset, std::uint64_t value, unsigned size )
+            {
+                std::memcpy( context.data() + ( offset & 0xff ), &value, std::min< std::uint64_t >( size, 256 - ( offset & 0xff ) ) );
+            }
+
+            // values take their own width on the stack, bytes a word
+            void push( std::uint64_t value, unsigned bits )
+            {
+                const auto size = bits < 16 ? 2u : bits / 8;
+                vsp -= size;
+                memory.write( vsp, value, size );
+            }
+
+            std::uint64_t pop( unsigned bits )
+            {
+                const auto size = bits < 16 ? 2u : bits / 8;
+                const auto value = memory.read( vsp, size );
+                vsp += size;
+                return value & mask( bits );
+            }
+
+            static constexpr std::uint64_t mask( unsigned bits )
+            {
+                return bits >= 64 ? ~0ull : ( 1ull << bits ) - 1;
+            }
+
+            bool operator==( const machine_t &other ) const
+            {
+                return context == other.context && vsp == other.vsp && rflags == other.rflags &&
+                       memory == other.memory;
+            }
+        };
+
+        // ( hi:lo ) / divisor without a 128 bit type, false if the quotient does not fit in 64 bits or the divisor is
+        // zero, where the native div would fault
+        inline bool divide( std::uint64_t hi, std::uint64_t lo, std::uint64_t divisor, std::uint64_t &quotient,
+                            std::uint64_t &remainder )
+        {
+            if ( !divisor || hi >= divisor )
+                return false;
+
+            quotient = 0;
+            for ( auto bit = 64; bit--; )
+            {
+                const bool carry = hi >> 63;
+                hi = hi << 1 | lo >> 63;
+                lo <<= 1;
+                quotient <<= 1;
+
+                if ( carry || hi >= divisor )
+                {
+                    hi -= divisor;
+                    quotient |= 1;
+                }
+            }
+
+            remainder = hi;
+            return true;
+        }
+
+        // high 64 bits of a * b
+        inline std::uint64_t multiply_high( std::uint64_t a, std::uint64_t b )
+        {
+            const auto a_lo = a & 0xffffffff, a_hi = a >> 32;
+            const auto b_lo = b & 0xffffffff, b_hi = b >> 32;
+
+            const auto lo_lo = a_lo * b_lo;
+            const auto hi_lo = a_hi * b_lo;
+            const auto lo_hi = a_lo * b_hi;
+            const auto hi_hi = a_hi * b_hi;
+
+            const auto cross = ( lo_lo >> 32 ) + ( hi_lo & 0xffffffff ) + lo_hi;
+            return hi_hi + ( hi_lo >> 32 ) + ( cross >> 32 );
+        }
+
+        enum class status_t
+        {
+            ok,
+            fault,       // the native handler would raise #DE
+            unsupported, // a virtual instruction without a handler here
+        };
+
+        struct op_t;
+
+        // returns the next op, or nullptr if the handler faulted
+        using handler_fn_t = const op_t *( * )( machine_t &machine, const op_t *op );
+
+        struct op_t
+        {
+            handler_fn_t handler;
+            std::uint64_t imm;
+        };
+
+        // a code block decoded once into a flat array of handlers and their immediates, so running it is an indirect
+        // call per virtual instruction and nothing else. the last op halts
+        struct program_t
+        {
+            std::vector< op_t > ops;
+        };
+
+        namespace handlers
+        {
+            using machine_t = interpreter::machine_t;
+
+            inline const op_t *halt( machine_t &, const op_t *op )
+            {
+                return op;
+            }
+
+            constexpr std::uint64_t flag_cf = 1ull << 0;
+            constexpr std::uint64_t flag_zf = 1ull << 6;
+            constexpr std::uint64_t flag_sf = 1ull << 7;
+            constexpr std::uint64_t flag_of = 1ull << 11;
+
+            // zf and sf of a result of N bits
+            template < unsigned N > constexpr std::uint64_t result_flags( std::uint64_t result )
+            {
+                return ( result & machine_t::mask( N ) ? 0 : flag_zf ) | ( result >> ( N - 1 ) & 1 ? flag_sf : 0 );
+            }
+
+            // replaces the bits of rflags in modified with flags, only with compute_flags
+            inline void update_flags( machine_t &m, std::uint64_t modified, std::uint64_t flags )
+            {
+                if ( m.compute_flags )
+                    m.rflags = ( m.rflags & ~modified ) | flags;
+            }
+
+            template < unsigned N > const op_t *lconst( machine_t &m, const op_t *op )
+            {
+                m.push( op->imm & machine_t::mask( N ), N );
+                return op + 1;
+            }
+
+            // lconst variants that extend an immediate of From bits to N bits
+            template < unsigned N, unsigned From, bool Signed > const op_t *lconst_extend( machine_t &m, const op_t *op )
+            {
+                auto value = op->imm & machine_t::mask( From );
+                if ( Signed && ( value >> ( From - 1 ) & 1 ) )
+                    value |= ~machine_t::mask( From );
+
+                m.push( value & machine_t::mask( N ), N );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *sreg( machine_t &m, const op_t *op )
+            {
+                m.write_context( op->imm, m.pop( N ), N / 8 );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *lreg( machine_t &m, const op_t *op )
+            {
+                m.push( m.read_context( op->imm, N / 8 ), N );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *add( machine_t &m, const op_t *op )
+            {
+                const auto t0 = m.pop( N );
+                const auto t1 = m.pop( N );
+                const auto result = ( t1 + t0 ) & machine_t::mask( N );
+
+                const auto overflow = ( ( t1 ^ result ) & ( t0 ^ result ) ) >> ( N - 1 ) & 1;
+                update_flags( m, flag_zf | flag_sf | flag_cf | flag_of,
+                              result_flags< N >( result ) | ( result < t0 ? flag_cf : 0 ) | ( overflow ? flag_of : 0 ) );
+
+                m.push( result, N );
+                m.push( m.rflags, 64 );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *nand( machine_t &m, const op_t *op )
+            {
+                const auto t0 = m.pop( N );
+                const auto t1 = m.pop( N );
+                const auto result = ~t0 & ~t1 & machine_t::mask( N );
+                update_flags( m, flag_zf | flag_sf | flag_cf | flag_of, result_flags< N >( result ) );
+
+                m.push( result, N );
+                m.push( m.rflags, 64 );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *read( machine_t &m, const op_t *op )
+            {
+                const auto address = m.pop( 64 );
+                m.push( m.memory.read( address, N / 8 ), N );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *write( machine_t &m, const op_t *op )
+            {
+                const auto address = m.pop( 64 );
+                const auto value = m.pop( N );
+                m.memory.write( address, value, N / 8 );
+                return op + 1;
+            }
+
+            // shift counts are masked like the native shr/shl do
+            template < unsigned N > constexpr unsigned count_mask = N == 64 ? 63 : 31;
+
+            template < unsigned N > const op_t *shr( machine_t &m, const op_t *op )
+            {
+                const auto t0 = m.pop( N );
+                const auto count = m.pop( N ) & count_mask< N >;
+                const auto result = count >= N ? 0 : t0 >> count;
+                if ( count )
+                    update_flags( m, flag_zf | flag_sf, result_flags< N >( result ) );
+
+                m.push( result, N );
+                m.push( m.rflags, 64 );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *shl( machine_t &m, const op_t *op )
+            {
+                const auto t0 = m.pop( N );
+                const auto count = m.pop( N ) & count_mask< N >;
+                const auto result = count >= N ? 0 : ( t0 << count ) & machine_t::mask( N );
+                if ( count )
+                    update_flags( m, flag_zf | flag_sf, result_flags< N >( result ) );
+
+                m.push( result, N );
+                m.push( m.rflags, 64 );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *shld( machine_t &m, const op_t *op )
+            {
+                const auto t0 = m.pop( N );
+                const auto t1 = m.pop( N );
+                const auto count = m.pop( N ) & count_mask< N >;
+                const auto result = count ? ( t0 << count | t1 >> ( N - count ) ) & machine_t::mask( N ) : t0;
+                if ( count )
+                    update_flags( m, flag_zf | flag_sf, result_flags< N >( result ) );
+
+                m.push( result, N );
+                m.push( m.rflags, 64 );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *shrd( machine_t &m, const op_t *op )
+            {
+                const auto t0 = m.pop( N );
+                const auto t1 = m.pop( N );
+                const auto count = m.pop( N ) & count_mask< N >;
+                const auto result = count ? ( t0 >> count | t1 << ( N - count ) ) & machine_t::mask( N ) : t0;
+                if ( count )
+                    update_flags( m, flag_zf | flag_sf, result_flags< N >( result ) );
+
+                m.push( result, N );
+                m.push( m.rflags, 64 );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *div( machine_t &m, const op_t *op )
+            {
+                const auto d = m.pop( N );
+                const auto a = m.pop( N );
+                const auto c = m.pop( N );
+
+                std::uint64_t quotient, remainder;
+                if ( N == 64 )
+                {
+                    if ( !divide( d, a, c, quotient, remainder ) )
+                        return nullptr;
+                }
+                else
+                {
+                    if ( !c )
+                        return nullptr;
+
+                    const auto dividend = d << N | a;
+                    quotient = dividend / c;
+                    remainder = dividend % c;
+                    if ( quotient > machine_t::mask( N ) )
+                        return nullptr;
+                }
+
+                m.push( quotient, N );
+                m.push( remainder, N );
+                m.push( m.rflags, 64 );
+                return op + 1;
+            }
+
+            template < unsigned N > const op_t *mul( machine_t &m, const op_t *op )
+            {
+                const auto d = m.pop( N );
+                const auto a = m.pop( N );
+
+                const auto lo = ( a * d ) & machine_t::mask( N );
+                const auto hi = ( N == 64 ? multiply_high( a, d ) : ( a * d ) >> ( N % 64 ) ) & machine_t::mask( N );
+                update_flags( m, flag_zf | flag_sf | flag_cf | flag_of,
+                              result_flags< N >( lo ) | ( hi ? flag_cf | flag_of : 0 ) );
+
+                m.push( lo, N );
+                m.push( hi, N );
+                m.push( m.rflags, 64 );
+                return op + 1;
+            }
+
+            inline const op_t *pushvsp( machine_t &m, const op_t *op )
+            {
+                m.push( m.vsp, 64 );
+                return op + 1;
+            }
+
+            inline const op_t *popvsp( machine_t &m, const op_t *op )
+            {
+                m.vsp = m.memory.read( m.vsp, 8 );
+                return op + 1;
+            }
+
+            inline const op_t *lflags( machine_t &m, const op_t *op )
+            {
+                m.rflags = m.pop( 64 );
+                return op + 1;
+            }
+
+            inline const op_t *rdtsc( machine_t &m, const op_t *op )
+            {
+                const auto tsc = m.tsc++;
+                m.push( tsc & 0xffffffff, 32 );
+                m.push( tsc >> 32, 32 );
+                return op + 1;
+            }
+        } // namespace handlers
+
+        struct handler_entry_t
+        {
+            vm::handler::mnemonic_t mnemonic;
+            handler_fn_t handler;
+        };
+
+        // every handled mnemonic, grouped by family like the lifter tables
+        constexpr handler_entry_t HandlerArray[] = {
+            { vm::handler::LCONSTQ, &handlers::lconst< 64 > },
+            { vm::handler::LCONSTDW, &handlers::lconst< 32 > },
+            { vm::handler::LCONSTW, &handlers::lconst< 16 > },
+            { vm::handler::LCONSTBSXQ, &handlers::lconst_extend< 64, 8, true > },
+            { vm::handler::LCONSTWSXQ, &handlers::lconst_extend< 64, 16, true > },
+            { vm::handler::LCONSTB2W, &handlers::lconst_extend< 16, 8, true > },
+            { vm::handler::LCONSTBZXW, &handlers::lconst_extend< 16, 8, false > },
+
+            { vm::handler::SREGQ, &handlers::sreg< 64 > },
+            { vm::handler::SREGDW, &handlers::sreg< 32 > },
+            { vm::handler::SREGW, &handlers::sreg< 16 > },
+            { vm::handler::SREGB, &handlers::sreg< 8 > },
+
+            { vm::handler::LREGQ, &handlers::lreg< 64 > },
+            { vm::handler::LREGDW, &handlers::lreg< 32 > },
+            { vm::handler::LREGW, &handlers::lreg< 16 > },
+            { vm::handler::LREGB, &handlers::lreg< 8 > },
+
+            { vm::handler::ADDQ, &handlers::add< 64 > },
+            { vm::handler::ADDDW, &handlers::add< 32 > },
+            { vm::handler::ADDW, &handlers::add< 16 > },
+            { vm::handler::ADDB, &handlers::add< 8 > },
+
+            { vm::handler::NANDQ, &handlers::nand< 64 > },
+            { vm::handler::NANDDW, &handlers::nand< 32 > },
+            { vm::handler::NANDW, &handlers::nand< 16 > },
+            { vm::handler::NANDB, &handlers::nand< 8 > },
+
+            { vm::handler::READQ, &handlers::read< 64 > },
+            { vm::handler::READDW, &handlers::read< 32 > },
+            { vm::handler::READW, &handlers::read< 16 > },
+            { vm::handler::READB, &handlers::read< 8 > },
+
+            { vm::handler::WRITEQ, &handlers::write< 64 > },
+            { vm::handler::WRITEDW, &handlers::write< 32 > },
+            { vm::handler::WRITEW, &handlers::write< 16 > },
+            { vm::handler::WRITEB, &handlers::write< 8 > },
+
+            { vm::handler::SHRQ, &handlers::shr< 64 > },
+            { vm::handler::SHRDW, &handlers::shr< 32 > },
+            { vm::handler::SHRW, &handlers::shr< 16 > },
+            { vm::handler::SHRB, &handlers::shr< 8 > },
+
+            { vm::handler::SHLQ, &handlers::shl< 64 > },
+            { vm::handler::SHLDW, &handlers::shl< 32 > },
+            { vm::handler::SHLW, &handlers::shl< 16 > },
+            { vm::handler::SHLB, &handlers::shl< 8 > },
+
+            { vm::handler::SHLDDW, &handlers::shld< 32 > },
+            { vm::handler::SHRDDW, &handlers::shrd< 32 > },
+
+            { vm::handler::DIVQ, &handlers::div< 64 > },
+            { vm::handler::DIVDW, &handlers::div< 32 > },
+            { vm::handler::DIVW, &handlers::div< 16 > },
+
+            { vm::handler::MULQ, &handlers::mul< 64 > },
+            { vm::handler::MULDW, &handlers::mul< 32 > },
+            { vm::handler::MULW, &handlers::mul< 16 > },
+
+            { vm::handler::PUSHVSPQ, &handlers::pushvsp },
+            { vm::handler::POPVSPQ, &handlers::popvsp },
+            { vm::handler::LFLAGSQ, &handlers::lflags },
+            { vm::handler::RDTSC, &handlers::rdtsc },
+        };
+
+        // HandlerTable[ mnemonic ] -> handler, built at compile time like the lifter tables and sized from the largest
+        // mnemonic in HandlerArray
+        constexpr std::size_t HandlerTableSize = []
+        {
+            std::size_t max_mnemonic = 0;
+            for ( const auto &entry : HandlerArray )
+                max_mnemonic = std::max< std::size_t >( max_mnemonic, entry.mnemonic );
+            return max_mnemonic + 1;
+        }();
+
+        constexpr std::array< handler_fn_t, HandlerTableSize > HandlerTable = []
+        {
+            std::array< handler_fn_t, HandlerTableSize > table{};
+            for ( const auto &entry : HandlerArray )
+                table[ entry.mnemonic ] = entry.handler;
+            return table;
+        }();
+
+        // false if a virtual instruction has no handler
+        inline bool decode( const vmp2::v3::code_block_t *code_blk, program_t &program )
+        {
+            program.ops.clear();
+            program.ops.reserve( code_blk->vinstr_count + 1 );
+
+            for ( auto idx = 0u; idx < code_blk->vinstr_count; ++idx )
+            {
+                const auto &vinstr = code_blk->vinstr[ idx ];
+                const auto mnemonic = static_cast< std::size_t >( vinstr.mnemonic_t );
+                if ( mnemonic >= HandlerTable.size() || !HandlerTable[ mnemonic ] )
+                    return false;
+
+                program.ops.push_back( { HandlerTable[ mnemonic ], vinstr.operand.imm.u } );
+            }
+
+            program.ops.push_back( { &handlers::halt, 0 } );
+            return true;
+        }
+
+        inline status_t run( const program_t &program, machine_t &machine )
+        {
+            if ( program.ops.empty() )
+                return status_t::unsupported;
+
+            const auto end = &program.ops.back();
+            for ( auto op = program.ops.data(); op != end; )
+            {
+                op = op->handler( machine, op );
+                if ( !op )
+                    return status_t::fault;
+            }
+
+            return status_t::ok;
+        }
+
+        inline status_t run( const vmp2::v3::code_block_t *code_blk, machine_t &machine )
+        {
+            program_t program;
+            if ( !decode( code_blk, program ) )
+                return status_t::unsupported;
+
+            return run( program, machine );
+        }
+    } // namespace interpreter
+} // namespace lifters
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace lifters
+{
+    // read only view of a whole file. pages are only faulted in when touched, and discard() hands pages that were
+    // already consumed back to the os so the resident set stays bounded while streaming over large files
+    class mapped_file_t
+    {
+      public:
+        mapped_file_t() = default;
+
+        mapped_file_t( const mapped_file_t & ) = delete;
+        mapped_file_t &operator=( const mapped_file_t & ) = delete;
+
+        ~mapped_file_t()
+        {
+            close();
+        }
+
+        bool open( const char *path )
+        {
+            close();
+#ifdef _WIN32
+            file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+            if ( file == INVALID_HANDLE_VALUE )
+                return false;
+
+            LARGE_INTEGER file_size;
+            if ( !GetFileSizeEx( file, &file_size ) || !file_size.QuadPart )
+            {
+                close();
+                return false;
+            }
+
+            mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+            if ( !mapping )
+            {
+                close();
+                return false;
+            }
+
+            view = static_cast< const std::uint8_t * >( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) );
+            if ( !view )
+            {
+                close();
+                return false;
+            }
+
+            length = static_cast< std::size_t >( file_size.QuadPart );
+#else
+            fd = ::open( path, O_RDONLY );
+            if ( fd < 0 )
+                return false;
+
+            struct stat st;
+            if ( fstat( fd, &st ) || !st.st_size )
+            {
+                close();
+                return false;
+            }
+
+            auto mem = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if ( mem == MAP_FAILED )
+            {
+                close();
+                return false;
+            }
+
+            view = static_cast< const std::uint8_t * >( mem );
+            length = static_cast< std::size_t >( st.st_size );
+            madvise( mem, length, MADV_SEQUENTIAL );
+#endif
+            return true;
+        }
+
+        void close()
+        {
+#ifdef _WIN32
+            if ( view )
+                UnmapViewOfFile( view );
+            if ( mapping )
+                CloseHandle( mapping );
+            if ( file != INVALID_HANDLE_VALUE )
+                CloseHandle( file );
+
+            mapping = nullptr;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if ( view )
+                munmap( const_cast< std::uint8_t * >( view ), length );
+            if ( fd >= 0 )
+                ::close( fd );
+
+            fd = -1;
+#endif
+            view = nullptr;
+            length = 0;
+        }
+
+        // drops the pages fully inside [offset, offset + size) from the resident set, they are read back from the
+        // file if touched again. returns where the dropped range ends so callers can continue from there
+        std::size_t discard( std::size_t offset, std::size_t size )
+        {
+            if ( !view || offset >= length )
+                return offset;
+
+            const auto page = page_size();
+            auto begin = ( offset + page - 1 ) / page * page;
+            auto end = std::min( offset + size, length ) / page * page;
+            if ( begin >= end )
+                return offset;
+#ifdef _WIN32
+            // unlocking pages that are not locked removes them from the working set
+            VirtualUnlock( const_cast< std::uint8_t * >( view ) + begin, end - begin );
+#else
+            madvise( const_cast< std::uint8_t * >( view ) + begin, end - begin, MADV_DONTNEED );
+#endif
+            return end;
+        }
+
+        const std::uint8_t *data() const
+        {
+            return view;
+        }
+
+        std::size_t size() const
+        {
+            return length;
+        }
+
+        bool is_open() const
+        {
+            return view != nullptr;
+        }
+
+      private:
+        static std::size_t page_size()
+        {
+#ifdef _WIN32
+            SYSTEM_INFO info;
+            GetSystemInfo( &info );
+            return info.dwPageSize;
+#else
+            return static_cast< std::size_t >( sysconf( _SC_PAGESIZE ) );
+#endif
+        }
+
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#else
+        int fd = -1;
+#endif
+        const std::uint8_t *view = nullptr;
+        std::size_t length = 0;
+    };
+} // namespace lifters
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstdint>
+#include <vmprofiles.hpp>
+
+namespace lifters
+{
+    // what a virtual instruction does, independent of the backend it is lifted to
+    enum class family_t : std::uint8_t
+    {
+        invalid,
+        lconst,
+        sreg,
+        lreg,
+        add,
+        nand,
+        read,
+        write,
+        shr,
+        shl,
+        shld,
+        shrd,
+        div,
+        mul,
+        pushvsp,
+        popvsp,
+        lflags,
+        rdtsc,
+    };
+
+    struct mnemonic_info_t
+    {
+        family_t family;
+
+        // width of the operation in bits, for sreg/lreg the width of the vm context access
+        std::uint8_t bits;
+    };
+
+    constexpr mnemonic_info_t get_mnemonic_info( vm::handler::mnemonic_t mnemonic )
+    {
+        switch ( mnemonic )
+        {
+        case vm::handler::LCONSTQ:
+        case vm::handler::LCONSTBSXQ:
+        case vm::handler::LCONSTWSXQ:
+            return { family_t::lconst, 64 };
+        case vm::handler::LCONSTDW:
+            return { family_t::lconst, 32 };
+        case vm::handler::LCONSTW:
+        case vm::handler::LCONSTB2W:
+        case vm::handler::LCONSTBZXW:
+            return { family_t::lconst, 16 };
+
+        case vm::handler::SREGQ:
+            return { family_t::sreg, 64 };
+        case vm::handler::SREGDW:
+            return { family_t::sreg, 32 };
+        case vm::handler::SREGW:
+            return { family_t::sreg, 16 };
+        case vm::handler::SREGB:
+            return { family_t::sreg, 8 };
+
+        case vm::handler::LREGQ:
+            return { family_t::lreg, 64 };
+        case vm::handler::LREGDW:
+            return { family_t::lreg, 32 };
+        case vm::handler::LREGW:
+            return { family_t::lreg, 16 };
+        case vm::handler::LREGB:
+            return { family_t::lreg, 8 };
+
+        case vm::handler::ADDQ:
+            return { family_t::add, 64 };
+        case vm::handler::ADDDW:
+            return { family_t::add, 32 };
+        case vm::handler::ADDW:
+            return { family_t::add, 16 };
+        case vm::handler::ADDB:
+            return { family_t::add, 8 };
+
+        case vm::handler::NANDQ:
+            return { family_t::nand, 64 };
+        case vm::handler::NANDDW:
+            return { family_t::nand, 32 };
+        case vm::handler::NANDW:
+            return { family_t::nand, 16 };
+        case vm::handler::NANDB:
+            return { family_t::nand, 8 };
+
+        case vm::handler::READQ:
+            return { family_t::read, 64 };
+        case vm::handler::READDW:
+            return { family_t::read, 32 };
+        case vm::handler::READW:
+            return { family_t::read, 16 };
+        case vm::handler::READB:
+            return { family_t::read, 8 };
+
+        case vm::handler::WRITEQ:
+            return { family_t::write, 64 };
+        case vm::handler::WRITEDW:
+            return { family_t::write, 32 };
+        case vm::handler::WRITEW:
+            return { family_t::write, 16 };
+        case vm::handler::WRITEB:
+            return { family_t::write, 8 };
+
+        case vm::handler::SHRQ:
+            return { family_t::shr, 64 };
+        case vm::handler::SHRDW:
+            return { family_t::shr, 32 };
+        case vm::handler::SHRW:
+            return { family_t::shr, 16 };
+        case vm::handler::SHRB:
+            return { family_t::shr, 8 };
+
+        case vm::handler::SHLQ:
+            return { family_t::shl, 64 };
+        case vm::handler::SHLDW:
+            return { family_t::shl, 32 };
+        case vm::handler::SHLW:
+            return { family_t::shl, 16 };
+        case vm::handler::SHLB:
+            return { family_t::shl, 8 };
+
+        case vm::handler::SHLDDW:
+            return { family_t::shld, 32 };
+        case vm::handler::SHRDDW:
+            return { family_t::shrd, 32 };
+
+        case vm::handler::DIVQ:
+            return { family_t::div, 64 };
+        case vm::handler::DIVDW:
+            return { family_t::div, 32 };
+        case vm::handler::DIVW:
+            return { family_t::div, 16 };
+
+        case vm::handler::MULQ:
+            return { family_t::mul, 64 };
+        case vm::handler::MULDW:
+            return { family_t::mul, 32 };
+        case vm::handler::MULW:
+            return { family_t::mul, 16 };
+
+        case vm::handler::PUSHVSPQ:
+            return { family_t::pushvsp, 64 };
+        case vm::handler::POPVSPQ:
+            return { family_t::popvsp, 64 };
+        case vm::handler::LFLAGSQ:
+            return { family_t::lflags, 64 };
+        case vm::handler::RDTSC:
+            return { family_t::rdtsc, 32 };
+
+        default:
+            return { family_t::invalid, 0 };
+        }
+    }
+
+    // these handlers push the flags they produced on top of their result
+    constexpr bool produces_flags( family_t family )
+    {
+        switch ( family )
+        {
+        case family_t::add:
+        case family_t::nand:
+        case family_t::shr:
+        case family_t::shl:
+        case family_t::shld:
+        case family_t::shrd:
+        case family_t::div:
+        case family_t::mul:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // these handlers leave some of the flags of the previous handler in the flags they push
+    constexpr bool keeps_flags( family_t family )
+    {
+        switch ( family )
+        {
+        case family_t::shr:
+        case family_t::shl:
+        case family_t::shld:
+        case family_t::shrd:
+        case family_t::div:
+            return true;
+        default:
+            return false;
+        }
+    }
+} // namespace lifters
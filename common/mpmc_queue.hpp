@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+namespace lifters
+{
+    // bounded multi producer multi consumer queue (dmitry vyukov's design). every cell carries a sequence number
+    // that tells producers and consumers whose turn it is, so pushes and pops only contend on one atomic each
+    // and never take a lock. capacity is rounded up to a power of two
+    template < class T > class mpmc_queue_t
+    {
+      public:
+        explicit mpmc_queue_t( std::size_t capacity )
+        {
+            std::size_t size = 2;
+            while ( size < capacity )
+                size <<= 1;
+
+            mask = size - 1;
+            cells = std::make_unique< cell_t[] >( size );
+            for ( std::size_t idx = 0; idx < size; ++idx )
+                cells[ idx ].sequence.store( idx, std::memory_order_relaxed );
+        }
+
+        mpmc_queue_t( const mpmc_queue_t & ) = delete;
+        mpmc_queue_t &operator=( const mpmc_queue_t & ) = delete;
+
+        bool try_push( T value )
+        {
+            auto pos = enqueue_pos.load( std::memory_order_relaxed );
+            for ( ;; )
+            {
+                auto &cell = cells[ pos & mask ];
+                const auto sequence = cell.sequence.load( std::memory_order_acquire );
+                const auto diff = static_cast< std::ptrdiff_t >( sequence ) - static_cast< std::ptrdiff_t >( pos );
+
+                if ( !diff )
+                {
+                    if ( enqueue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                    {
+                        cell.value = std::move( value );
+                        cell.sequence.store( pos + 1, std::memory_order_release );
+                        return true;
+                    }
+                }
+                else if ( diff < 0 )
+                    return false; // full
+                else
+                    pos = enqueue_pos.load( std::memory_order_relaxed );
+            }
+        }
+
+        bool try_pop( T &value )
+        {
+            auto pos = dequeue_pos.load( std::memory_order_relaxed );
+            for ( ;; )
+            {
+                auto &cell = cells[ pos & mask ];
+                const auto sequence = cell.sequence.load( std::memory_order_acquire );
+                const auto diff = static_cast< std::ptrdiff_t >( sequence ) - static_cast< std::ptrdiff_t >( pos + 1 );
+
+                if ( !diff )
+                {
+                    if ( dequeue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                    {
+                        value = std::move( cell.value );
+                        cell.sequence.store( pos + mask + 1, std::memory_order_release );
+                        return true;
+                    }
+                }
+                else if ( diff < 0 )
+                    return false; // empty
+                else
+                    pos = dequeue_pos.load( std::memory_order_relaxed );
+            }
+        }
+
+        // blocks while the queue is full, this is what pushes back on faster stages
+        void push( T value )
+        {
+            for ( unsigned spins = 0; !try_push( value ); ++spins )
+                backoff( spins );
+        }
+
+        std::size_t capacity() const
+        {
+            return mask + 1;
+        }
+
+        static void backoff( unsigned spins )
+        {
+            if ( spins < 64 )
+                return;
+
+            std::this_thread::yield();
+        }
+
+      private:
+        struct cell_t
+        {
+            std::atomic< std::size_t > sequence;
+            T value;
+        };
+
+        static constexpr std::size_t cache_line = 64;
+
+        std::unique_ptr< cell_t[] > cells;
+        std::size_t mask = 0;
+
+        alignas( cache_line ) std::atomic< std::size_t > enqueue_pos = 0;
+        alignas( cache_line ) std::atomic< std::size_t > dequeue_pos = 0;
+    };
+} // namespace lifters
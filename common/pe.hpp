@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+namespace lifters
+{
+    // a vm entry stub: push imm32 (the encrypted vip), call vm_enter
+    struct vm_entry_t
+    {
+        std::uint32_t rva;
+        std::uint32_t vm_enter_rva;
+        std::uint32_t encrypted_vip;
+    };
+
+    // a pe64 file laid out the way the loader would map it, sections at their virtual addresses. only what the vm
+    // profiler needs, no relocations or imports are processed
+    class pe_image_t
+    {
+      public:
+        struct section_t
+        {
+            std::uint32_t rva;
+            std::uint32_t size;
+            bool executable;
+        };
+
+        bool load( const mapped_file_t &file )
+        {
+            image.clear();
+            sections.clear();
+
+            const auto data = file.data();
+            const auto size = file.size();
+
+            std::uint32_t nt_offset;
+            if ( size < 0x40 || read< std::uint16_t >( data, 0 ) != 0x5a4d ) // "MZ"
+                return false;
+
+            nt_offset = read< std::uint32_t >( data, 0x3c );
+            if ( std::uint64_t( nt_offset ) + 0x108 > size || read< std::uint32_t >( data, nt_offset ) != 0x4550 ||
+                 read< std::uint16_t >( data, nt_offset + 0x18 ) != 0x20b ) // "PE", pe32+ optional header
+                return false;
+
+            const auto section_count = read< std::uint16_t >( data, nt_offset + 0x6 );
+            const auto optional_size = read< std::uint16_t >( data, nt_offset + 0x14 );
+            const auto optional = nt_offset + 0x18;
+
+            image_base = read< std::uint64_t >( data, optional + 0x18 );
+            const auto image_size = read< std::uint32_t >( data, optional + 0x38 );
+            const auto headers_size = read< std::uint32_t >( data, optional + 0x3c );
+
+            const auto section_table = std::uint64_t( optional ) + optional_size;
+            if ( section_table + section_count * 0x28ull > size || headers_size > image_size )
+                return false;
+
+            image.assign( image_size, 0 );
+            std::memcpy( image.data(), data, std::min< std::uint64_t >( { headers_size, size, image_size } ) );
+
+            for ( auto idx = 0u; idx < section_count; ++idx )
+            {
+                const auto header = section_table + idx * 0x28ull;
+                const auto virtual_size = read< std::uint32_t >( data, header + 0x8 );
+                const auto rva = read< std::uint32_t >( data, header + 0xc );
+                const auto raw_size = read< std::uint32_t >( data, header + 0x10 );
+                const auto raw_offset = read< std::uint32_t >( data, header + 0x14 );
+                const auto characteristics = read< std::uint32_t >( data, header + 0x24 );
+
+                if ( rva >= image_size )
+                    continue;
+
+                const auto mapped = std::min< std::uint64_t >( { virtual_size ? virtual_size : raw_size,
+                                                                 image_size - std::uint64_t( rva ) } );
+                const auto copied = std::min< std::uint64_t >(
+                    { raw_size, mapped, raw_offset < size ? size - raw_offset : 0ull } );
+                if ( copied )
+                    std::memcpy( image.data() + rva, data + raw_offset, copied );
+
+                sections.push_back( { rva, static_cast< std::uint32_t >( mapped ),
+                                      ( characteristics & 0x20000000 ) != 0 } ); // IMAGE_SCN_MEM_EXECUTE
+            }
+
+            return true;
+        }
+
+        bool is_executable( std::uint64_t rva ) const
+        {
+            return std::any_of( sections.begin(), sections.end(), [ & ]( const section_t &section )
+                                { return section.executable && rva >= section.rva && rva < section.rva + section.size; } );
+        }
+
+        // every push imm32; call rel32 in an executable section that calls into an executable section. vmprotect
+        // emits one of these for every virtualized function, entries calling the same vm_enter share its handlers
+        std::vector< vm_entry_t > find_vm_entries() const
+        {
+            std::vector< vm_entry_t > entries;
+            std::unordered_set< std::uint32_t > seen;
+
+            for ( const auto &section : sections )
+            {
+                if ( !section.executable || section.size < 10 )
+                    continue;
+
+                const auto bytes = image.data() + section.rva;
+                for ( std::uint32_t offset = 0; offset + 10 <= section.size; ++offset )
+                {
+                    if ( bytes[ offset ] != 0x68 || bytes[ offset + 5 ] != 0xe8 )
+                        continue;
+
+                    const auto rva = section.rva + offset;
+                    const auto displacement = read< std::int32_t >( bytes, offset + 6 );
+                    const auto target = std::int64_t( rva ) + 10 + displacement;
+                    if ( target < 0 || !is_executable( static_cast< std::uint64_t >( target ) ) || !seen.insert( rva ).second )
+                        continue;
+
+                    entries.push_back( { rva, static_cast< std::uint32_t >( target ), read< std::uint32_t >( bytes, offset + 1 ) } );
+                }
+            }
+
+            return entries;
+        }
+
+        const std::uint8_t *data() const
+        {
+            return image.data();
+        }
+
+        std::size_t size() const
+        {
+            return image.size();
+        }
+
+        std::uint64_t preferred_base() const
+        {
+            return image_base;
+        }
+
+      private:
+        template < typename T > static T read( const std::uint8_t *data, std::uint64_t offset )
+        {
+            T value;
+            std::memcpy( &value, data + offset, sizeof( value ) );
+            return value;
+        }
+
+        std::vector< std::uint8_t > image;
+        std::vector< section_t > sections;
+        std::uint64_t image_base = 0;
+    };
+} // namespace lifters
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <vmprofiles.hpp>
+
+#include "mnemonic.hpp"
+
+// synthetic virtual instruction streams for benchmarks and differential testing of the lifters
+
+namespace lifters
+{
+    namespace synthetic
+    {
+        // a vmp2::v3::code_block_t with room for its virtual instructions, they live right behind the header
+        class code_block_buffer_t
+        {
+          public:
+            explicit code_block_buffer_t( const std::vector< vm::instrs::virt_instr_t > &vinstrs, std::uintptr_t vip = 0 )
+                : buffer( ( sizeof( vmp2::v3::code_block_t ) + vinstrs.size() * sizeof( vm::instrs::virt_instr_t ) +
+                            sizeof( std::uint64_t ) - 1 ) /
+                          sizeof( std::uint64_t ) )
+            {
+                auto code_blk = get();
+                code_blk->vip_begin = vip;
+                code_blk->next_block_offset = buffer.size() * sizeof( std::uint64_t );
+                code_blk->jcc = {};
+                code_blk->vinstr_count = static_cast< std::uint32_t >( vinstrs.size() );
+                std::memcpy( code_blk->vinstr, vinstrs.data(), vinstrs.size() * sizeof( vm::instrs::virt_instr_t ) );
+            }
+
+            vmp2::v3::code_block_t *get()
+            {
+                return reinterpret_cast< vmp2::v3::code_block_t * >( buffer.data() );
+            }
+
+          private:
+            std::vector< std::uint64_t > buffer;
+        };
+
+        inline vm::instrs::virt_instr_t make_vinstr( vm::handler::mnemonic_t mnemonic, std::uint64_t imm = 0,
+                                                     std::uint8_t imm_size = 0 )
+        {
+            vm::instrs::virt_instr_t vinstr = {};
+            vinstr.mnemonic_t = mnemonic;
+            vinstr.operand.has_imm = imm_size != 0;
+            vinstr.operand.imm.imm_size = imm_size;
+            vinstr.operand.imm.u = imm;
+            return vinstr;
+        }
+
+        class stream_builder_t
+        {
+          public:
+            explicit stream_builder_t( std::uint32_t seed = 0 ) : rng( seed )
+            {
+            }
+
+            // vm register offsets are 8 byte aligned slots of the vm context
+            std::uint8_t context_offset( std::uint8_t bits = 64 )
+            {
+                return static_cast< std::uint8_t >( ( rng() % 24 ) * 8 + ( bits < 64 ? rng() % ( 8 - bits / 8 + 1 ) : 0 ) );
+            }
+
+            stream_builder_t &emit( vm::handler::mnemonic_t mnemonic, std::uint64_t imm = 0, std::uint8_t imm_size = 0 )
+            {
+                vinstrs.push_back( make_vinstr( mnemonic, imm, imm_size ) );
+                return *this;
+            }
+
+            stream_builder_t &lconst( std::uint8_t bits )
+            {
+                switch ( bits )
+                {
+                case 64:
+                    return emit( vm::handler::LCONSTQ, rng(), 64 );
+                case 32:
+                    return emit( vm::handler::LCONSTDW, rng() & 0xffffffff, 32 );
+                default:
+                    return emit( vm::handler::LCONSTW, rng() & 0xffff, 16 );
+                }
+            }
+
+            stream_builder_t &lreg( std::uint8_t bits )
+            {
+                static constexpr vm::handler::mnemonic_t lregs[] = { vm::handler::LREGB, vm::handler::LREGW,
+                                                                      vm::handler::LREGDW, vm::handler::LREGQ };
+                return emit( lregs[ width_index( bits ) ], context_offset( bits ), 8 );
+            }
+
+            stream_builder_t &sreg( std::uint8_t bits )
+            {
+                static constexpr vm::handler::mnemonic_t sregs[] = { vm::handler::SREGB, vm::handler::SREGW,
+                                                                      vm::handler::SREGDW, vm::handler::SREGQ };
+                return emit( sregs[ width_index( bits ) ], context_offset( bits ), 8 );
+            }
+
+            std::vector< vm::instrs::virt_instr_t > vinstrs;
+            std::mt19937_64 rng;
+
+          private:
+            static std::size_t width_index( std::uint8_t bits )
+            {
+                return bits == 64 ? 3 : bits == 32 ? 2 : bits == 16 ? 1 : 0;
+            }
+        };
+
+        // the handler with operands pushed in front of it and its results stored to vm registers behind it
+        inline std::vector< vm::instrs::virt_instr_t > handler_stream( vm::handler::mnemonic_t mnemonic,
+                                                                      std::size_t repeat, std::uint32_t seed = 0 )
+        {
+            stream_builder_t builder( seed );
+            const auto info = get_mnemonic_info( mnemonic );
+            const auto bits = info.bits;
+
+            for ( std::size_t count = 0; count < repeat; ++count )
+            {
+                switch ( info.family )
+                {
+                case family_t::lconst:
+                    builder.emit( mnemonic, builder.rng() & 0xff, 8 ).sreg( bits );
+                    break;
+                case family_t::sreg:
+                    builder.lreg( bits ).emit( mnemonic, builder.context_offset( bits ), 8 );
+                    break;
+                case family_t::lreg:
+                    builder.emit( mnemonic, builder.context_offset( bits ), 8 ).sreg( bits );
+                    break;
+                case family_t::add:
+                case family_t::nand:
+                case family_t::shr:
+                case family_t::shl:
+                    builder.lreg( bits ).lreg( bits ).emit( mnemonic ).sreg( 64 ).sreg( bits );
+                    break;
+                case family_t::shld:
+                case family_t::shrd:
+                    builder.lreg( bits ).lreg( bits ).lreg( bits ).emit( mnemonic ).sreg( 64 ).sreg( bits );
+                    break;
+                case family_t::div:
+                    builder.lreg( bits ).lreg( bits ).lreg( bits ).emit( mnemonic ).sreg( 64 ).sreg( bits ).sreg( bits );
+                    break;
+                case family_t::mul:
+                    builder.lreg( bits ).lreg( bits ).emit( mnemonic ).sreg( 64 ).sreg( bits ).sreg( bits );
+                    break;
+                case family_t::read:
+                    builder.lreg( 64 ).emit( mnemonic ).sreg( bits );
+                    break;
+                case family_t::write:
+                    builder.lreg( bits ).lreg( 64 ).emit( mnemonic );
+                    break;
+                case family_t::pushvsp:
+                    builder.emit( mnemonic ).sreg( 64 );
+                    break;
+                case family_t::popvsp:
+                    builder.emit( vm::handler::PUSHVSPQ ).emit( mnemonic );
+                    break;
+                case family_t::lflags:
+                    builder.lreg( 64 ).emit( mnemonic );
+                    break;
+                case family_t::rdtsc:
+                    builder.emit( mnemonic ).sreg( 32 ).sreg( 32 );
+                    break;
+                default:
+                    builder.emit( mnemonic );
+                    break;
+                }
+            }
+
+            return builder.vinstrs;
+        }
+
+        struct workload_t
+        {
+            std::string name;
+            std::vector< vm::instrs::virt_instr_t > vinstrs;
+        };
+
+        // streams shaped like the blocks vmprotect generates
+        inline std::vector< workload_t > mixed_workloads( std::size_t repeat, std::uint32_t seed = 0 )
+        {
+            std::vector< workload_t > workloads;
+
+            // vm entry: every native register is popped into the vm context
+            {
+                stream_builder_t builder( seed );
+                for ( std::size_t count = 0; count < repeat; ++count )
+                    for ( auto reg = 0u; reg < 16; ++reg )
+                        builder.sreg( 64 );
+                workloads.push_back( { "vm_enter", std::move( builder.vinstrs ) } );
+            }
+
+            // long lconst/sreg/nand chains with the flags stored to scratch registers
+            {
+                stream_builder_t builder( seed );
+                for ( std::size_t count = 0; count < repeat; ++count )
+                {
+                    builder.lconst( 64 ).sreg( 64 ).lreg( 64 ).lconst( 64 ).emit( vm::handler::NANDQ ).sreg( 64 ).sreg(
+                        64 );
+                }
+                workloads.push_back( { "lconst_sreg_nand", std::move( builder.vinstrs ) } );
+            }
+
+            // the nand encoding of xor
+            {
+                stream_builder_t builder( seed );
+                for ( std::size_t count = 0; count < repeat; ++count )
+                {
+                    const auto a = builder.context_offset(), b = builder.context_offset(), f = builder.context_offset();
+                    builder.emit( vm::handler::LREGQ, a, 8 ).emit( vm::handler::LREGQ, b, 8 ).emit( vm::handler::NANDQ );
+                    builder.emit( vm::handler::SREGQ, f, 8 ).emit( vm::handler::LREGQ, a, 8 ).emit( vm::handler::LREGQ, a, 8 );
+                    builder.emit( vm::handler::NANDQ ).emit( vm::handler::SREGQ, f, 8 ).emit( vm::handler::LREGQ, b, 8 );
+                    builder.emit( vm::handler::LREGQ, b, 8 ).emit( vm::handler::NANDQ ).emit( vm::handler::SREGQ, f, 8 );
+                    builder.emit( vm::handler::NANDQ ).emit( vm::handler::SREGQ, f, 8 ).emit( vm::handler::NANDQ );
+                    builder.emit( vm::handler::SREGQ, f, 8 ).sreg( 64 );
+                }
+                workloads.push_back( { "nand_xor", std::move( builder.vinstrs ) } );
+            }
+
+            // address computation and memory access
+            {
+                stream_builder_t builder( seed );
+                for ( std::size_t count = 0; count < repeat; ++count )
+                {
+                    builder.lreg( 64 ).lconst( 64 ).emit( vm::handler::ADDQ ).sreg( 64 ).emit( vm::handler::READQ ).sreg(
+                        64 );
+                    builder.lreg( 32 ).lreg( 64 ).emit( vm::handler::WRITEDW );
+                }
+                workloads.push_back( { "memory", std::move( builder.vinstrs ) } );
+            }
+
+            return workloads;
+        }
+
+        // a shr/shl of a constant by a constant count, the result and flags stored to vm registers. the counts
+        // cover the edges of the native count mask for every operand width, including counts of N or more. byte
+        // operands are pushed with lconstbzxw like the vm does, every count fits in their 8 bit immediate
+        inline std::vector< workload_t > shift_count_workloads( std::uint32_t seed = 0 )
+        {
+            struct shift_t
+            {
+                const char *name;
+                vm::handler::mnemonic_t mnemonic;
+                vm::handler::mnemonic_t lconst;
+                std::uint8_t bits;
+            };
+
+            static constexpr shift_t shifts[] = {
+                { "shrq", vm::handler::SHRQ, vm::handler::LCONSTQ, 64 },
+                { "shlq", vm::handler::SHLQ, vm::handler::LCONSTQ, 64 },
+                { "shrdw", vm::handler::SHRDW, vm::handler::LCONSTDW, 32 },
+                { "shldw", vm::handler::SHLDW, vm::handler::LCONSTDW, 32 },
+                { "shrw", vm::handler::SHRW, vm::handler::LCONSTW, 16 },
+                { "shlw", vm::handler::SHLW, vm::handler::LCONSTW, 16 },
+                { "shrb", vm::handler::SHRB, vm::handler::LCONSTBZXW, 8 },
+                { "shlb", vm::handler::SHLB, vm::handler::LCONSTBZXW, 8 },
+            };
+
+            std::vector< workload_t > workloads;
+            stream_builder_t builder( seed );
+
+            for ( const auto &shift : shifts )
+            {
+                const std::uint64_t counts[] = { 0, 1, shift.bits - 1u, shift.bits, shift.bits + 1u, 31, 32, 63, 64, 255 };
+                const auto mask = shift.bits == 64 ? ~0ull : ( 1ull << shift.bits ) - 1;
+
+                for ( const auto count : counts )
+                {
+                    if ( count > mask )
+                        continue;
+
+                    // the count is pushed first, the value ends up on top
+                    builder.vinstrs.clear();
+                    builder.emit( shift.lconst, count, shift.bits )
+                        .emit( shift.lconst, builder.rng() & mask, shift.bits )
+                        .emit( shift.mnemonic )
+                        .sreg( 64 )
+                        .sreg( shift.bits );
+
+                    workloads.push_back( { std::string( shift.name ) + "_by_" + std::to_string( count ), builder.vinstrs } );
+                }
+            }
+
+            return workloads;
+        }
+    } // namespace synthetic
+} // namespace lifters
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lifters
+{
+    inline unsigned default_thread_count()
+    {
+        return std::max( 1u, std::thread::hardware_concurrency() );
+    }
+
+    // runs fn( worker, idx ) for every idx in [ 0, count ). each worker starts with a contiguous range of indices
+    // and takes from the front of its own queue, once that runs dry it steals from the back of the others.
+    // returns after every index has been processed
+    template < typename F >
+    void parallel_for( std::size_t count, unsigned thread_count, F &&fn )
+    {
+        thread_count = static_cast< unsigned >( std::min< std::size_t >( std::max( 1u, thread_count ), count ) );
+        if ( thread_count <= 1 )
+        {
+            for ( std::size_t idx = 0; idx < count; ++idx )
+                fn( 0u, idx );
+            return;
+        }
+
+        struct queue_t
+        {
+            std::mutex mutex;
+            std::deque< std::size_t > indices;
+        };
+
+        std::vector< queue_t > queues( thread_count );
+        for ( std::size_t idx = 0; idx < count; ++idx )
+            queues[ idx * thread_count / count ].indices.push_back( idx );
+
+        const auto take = [ & ]( unsigned worker, std::size_t &idx ) -> bool
+        {
+            {
+                std::lock_guard lock( queues[ worker ].mutex );
+                if ( !queues[ worker ].indices.empty() )
+                {
+                    idx = queues[ worker ].indices.front();
+                    queues[ worker ].indices.pop_front();
+                    return true;
+                }
+            }
+
+            for ( unsigned offset = 1; offset < thread_count; ++offset )
+            {
+                auto &victim = queues[ ( worker + offset ) % thread_count ];
+                std::lock_guard lock( victim.mutex );
+                if ( !victim.indices.empty() )
+                {
+                    idx = victim.indices.back();
+                    victim.indices.pop_back();
+                    return true;
+                }
+            }
+
+            return false;
+        };
+
+        const auto work = [ & ]( unsigned worker )
+        {
+            // nothing is ever added to the queues, so a worker that finds them all empty is done
+            for ( std::size_t idx; take( worker, idx ); )
+                fn( worker, idx );
+        };
+
+        std::vector< std::thread > threads;
+        for ( unsigned worker = 1; worker < thread_count; ++worker )
+            threads.emplace_back( work, worker );
+
+        work( 0 );
+
+        for ( auto &thread : threads )
+            thread.join();
+    }
+} // namespace lifters
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vmprofiles.hpp>
+
+#include "mapped_file.hpp"
+
+namespace lifters
+{
+    // walks the code blocks of a memory mapped vmp2 v3 trace one at a time. nothing is copied, the blocks handed
+    // out point straight into the mapping, and every block is bounds checked against the file before it is
+    // returned so a truncated trace ends the walk instead of reading past the mapping
+    class trace_reader_t
+    {
+      public:
+        bool open( const char *path )
+        {
+            if ( !file.open( path ) )
+                return false;
+
+            if ( file.size() < sizeof( vmp2::v3::file_header ) || header()->version != vmp2::version_t::v3 ||
+                 header()->code_block_offset > file.size() )
+            {
+                file.close();
+                return false;
+            }
+
+            rewind();
+            return true;
+        }
+
+        const vmp2::v3::file_header *header() const
+        {
+            return reinterpret_cast< const vmp2::v3::file_header * >( file.data() );
+        }
+
+        void rewind()
+        {
+            offset = header()->code_block_offset;
+            block_count = header()->code_block_count;
+            current = released = index = 0;
+        }
+
+        // the mapping is read only, the lifters never write to the code blocks they are given
+        vmp2::v3::code_block_t *next()
+        {
+            if ( index >= block_count )
+                return nullptr;
+
+            const auto header_size = offsetof( vmp2::v3::code_block_t, vinstr );
+            if ( offset + header_size > file.size() )
+                return nullptr;
+
+            auto code_blk = reinterpret_cast< vmp2::v3::code_block_t * >( const_cast< std::uint8_t * >( file.data() ) +
+                                                                         offset );
+
+            const auto block_size =
+                header_size + static_cast< std::size_t >( code_blk->vinstr_count ) * sizeof( vm::instrs::virt_instr_t );
+
+            if ( offset + block_size > file.size() || code_blk->next_block_offset < block_size )
+                return nullptr;
+
+            current = offset;
+            offset += code_blk->next_block_offset;
+            ++index;
+            return code_blk;
+        }
+
+        // gives every page before the block returned last back to the os
+        void release_consumed()
+        {
+            released = file.discard( released, current - released );
+        }
+
+        std::size_t block_index() const
+        {
+            return index;
+        }
+
+        std::size_t bytes_consumed() const
+        {
+            return offset;
+        }
+
+        std::size_t size() const
+        {
+            return file.size();
+        }
+
+      private:
+        mapped_file_t file;
+        std::size_t offset = 0;
+        std::size_t current = 0;
+        std::size_t released = 0;
+        std::size_t index = 0;
+        std::size_t block_count = 0;
+    };
+} // namespace lifters
@@ -0,0 +1,223 @@
+#pragma once
+
+// vtil before llvm.hpp, its headers are not written for the using namespace llvm in there
+#include "../common/synthetic.hpp"
+#include "../vtil/oracle.hpp"
+#include "llvm.hpp"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/Support/TargetSelect.h>
+
+namespace lifters
+{
+    namespace lifter_llvm
+    {
+        // runs the same synthetic blocks lifted by both backends and compares the states they end in. the vtil
+        // block is evaluated by lifter_vtil::oracle, the llvm block is optimized and jitted for the host and called
+        // on a copy of the vm context and of the stack around vsp.
+        //
+        // read/write address memory directly and pushvsp/popvsp see the host address of the stack in llvm, so
+        // their blocks are not compared. neither is rdtsc
+        namespace compare
+        {
+            using interpreter::machine_t;
+
+            enum class verdict_t
+            {
+                match,
+                mismatch,    // the llvm block ends in a different state than the vtil block for some input
+                unsupported, // either backend could not lift the block or the interpreter could not run it
+            };
+
+            struct result_t
+            {
+                std::string name;
+                verdict_t verdict = verdict_t::unsupported;
+
+                // inputs both backends ran. inputs the handlers fault on are skipped, the llvm blocks trap on them like
+                // the native div raises #DE and would take the process down
+                std::size_t inputs = 0;
+            };
+
+            using block_fn_t = void ( * )( void *vmctx, std::uint64_t *vsp, std::uint64_t *rflags );
+
+            // bytes of stack on either side of vsp the llvm block can touch
+            constexpr std::uint64_t stack_window = 0x1000;
+
+            // calls the jitted block on the machine, false if it moved vsp out of the window
+            inline bool run( block_fn_t function, machine_t &machine )
+            {
+                auto context = machine.context;
+                std::vector< std::uint8_t > stack( stack_window * 2 );
+
+                const auto base = machine.vsp - stack_window;
+                for ( std::uint64_t idx = 0; idx < stack.size(); ++idx )
+                    stack[ idx ] = static_cast< std::uint8_t >( machine.memory.read( base + idx, 1 ) );
+
+                const auto host_vsp = reinterpret_cast< std::uint64_t >( stack.data() ) + stack_window;
+                auto vsp = host_vsp;
+                auto rflags = machine.rflags;
+                function( context.data(), &vsp, &rflags );
+
+                const auto moved = static_cast< std::int64_t >( vsp - host_vsp );
+                const auto window = static_cast< std::int64_t >( stack_window );
+                if ( moved < -window || moved >= window )
+                    return false;
+
+                machine.context = context;
+                machine.vsp += moved;
+                machine.rflags = rflags;
+                for ( std::uint64_t idx = 0; idx < stack.size(); ++idx )
+                    machine.memory.write( base + idx, stack[ idx ], 1 );
+
+                return true;
+            }
+
+            // every handler the two backends lift, in a synthetic::handler_stream of repeat instances, against inputs
+            // random vm contexts. the llvm blocks are optimized at level first. empty if the host has no jit
+            inline std::vector< result_t > handlers( opt_level_t level = opt_level_t::O2, std::size_t repeat = 4,
+                                                     std::size_t inputs = 16, std::uint32_t seed = 0 )
+            {
+                static const bool initialized = []
+                {
+                    llvm::InitializeNativeTarget();
+                    llvm::InitializeNativeTargetAsmPrinter();
+                    return true;
+                }();
+                ( void )initialized;
+
+                struct block_t
+                {
+                    result_t result;
+                    synthetic::code_block_buffer_t code_blk;
+                    std::unique_ptr< lifter_vtil::oracle::differential_t > vtil;
+                    std::string symbol;
+                };
+
+                auto jit = llvm::orc::LLJITBuilder().create();
+                if ( !jit )
+                {
+                    llvm::consumeError( jit.takeError() );
+                    return {};
+                }
+
+                // the 128 bit divisions of divq are calls into the runtime of the host
+                if ( auto generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                         ( *jit )->getDataLayout().getGlobalPrefix() ) )
+                    ( *jit )->getMainJITDylib().addGenerator( std::move( *generator ) );
+                else
+                    llvm::consumeError( generator.takeError() );
+
+                auto context = std::make_unique< llvm::LLVMContext >();
+                auto module = std::make_unique< llvm::Module >( "compare", *context );
+                module->setDataLayout( ( *jit )->getDataLayout() );
+                module->setTargetTriple( ( *jit )->getTargetTriple().str() );
+
+                std::vector< block_t > blocks;
+                for ( const auto &lifter : LiftersArray )
+                {
+                    switch ( get_mnemonic_info( lifter.mnemonic ).family )
+                    {
+                    case family_t::read:
+                    case family_t::write:
+                    case family_t::pushvsp:
+                    case family_t::popvsp:
+                    case family_t::rdtsc:
+                        continue;
+                    default:
+                        break;
+                    }
+
+                    // the vip only has to make the function names unique
+                    const auto vip = blocks.size() + 1;
+                    block_t block = { {},
+                                      synthetic::code_block_buffer_t(
+                                          synthetic::handler_stream( lifter.mnemonic, repeat, seed ), vip ),
+                                      std::make_unique< lifter_vtil::oracle::differential_t >() };
+                    block.result.name = "mnemonic_" + std::to_string( static_cast< int >( lifter.mnemonic ) );
+
+                    const auto function = lift( *module, block.code_blk.get() );
+                    if ( function && block.vtil->prepare( block.code_blk.get() ) )
+                        block.symbol = function->getName().str();
+
+                    blocks.push_back( std::move( block ) );
+                }
+
+                optimize( *module, level );
+
+                if ( auto error =
+                         ( *jit )->addIRModule( llvm::orc::ThreadSafeModule( std::move( module ), std::move( context ) ) ) )
+                {
+                    llvm::consumeError( std::move( error ) );
+                    return {};
+                }
+
+                std::mt19937_64 rng( seed );
+                std::vector< result_t > results;
+
+                for ( auto &block : blocks )
+                {
+                    auto &result = block.result;
+                    if ( block.symbol.empty() )
+                    {
+                        results.push_back( result );
+                        continue;
+                    }
+
+                    auto address = ( *jit )->lookup( block.symbol );
+                    if ( !address )
+                    {
+                        llvm::consumeError( address.takeError() );
+                        results.push_back( result );
+                        continue;
+                    }
+
+#if LLVM_VERSION_MAJOR >= 15
+                    const auto function = address->toPtr< block_fn_t >();
+#else
+                    const auto function = reinterpret_cast< block_fn_t >( address->getAddress() );
+#endif
+                    result.verdict = verdict_t::match;
+
+                    for ( std::size_t input = 0; input < inputs && result.verdict == verdict_t::match; ++input )
+                    {
+                        const auto machine = lifter_vtil::oracle::random_machine( rng );
+
+                        machine_t vtil_state;
+                        const auto vtil_verdict = block.vtil->check( machine, nullptr, &vtil_state );
+                        if ( vtil_verdict == lifter_vtil::oracle::verdict_t::fault )
+                            continue;
+                        if ( vtil_verdict == lifter_vtil::oracle::verdict_t::unsupported )
+                        {
+                            result.verdict = verdict_t::unsupported;
+                            break;
+                        }
+
+                        auto llvm_state = machine;
+                        if ( !run( function, llvm_state ) )
+                        {
+                            result.verdict = verdict_t::unsupported;
+                            break;
+                        }
+
+                        ++result.inputs;
+                        if ( !( llvm_state == vtil_state ) )
+                            result.verdict = verdict_t::mismatch;
+                    }
+
+                    results.push_back( result );
+                }
+
+                return results;
+            }
+        } // namespace compare
+    } // namespace lifter_llvm
+} // namespace lifters
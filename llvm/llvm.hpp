@@ -1,14 +1,31 @@
 /*
-This project no longer uses llvm, although it is better than vtil
+LLVM IR backend for the same virtual instructions lifter_vtil handles, used to compare lift and optimize throughput
+and output quality against vtil. every code block is lifted into a function
+
+    void @vmp_<vip>( ptr %vmctx, ptr %vsp, ptr %rflags )
+
+vmctx points to the vm context (the vm registers), vsp to the virtual stack pointer and rflags to the native flags.
+memory accessed by read/write handlers is addressed directly through inttoptr
+
+builds with LLVM 14 to 16. LLVM 14 still has typed pointers: vmctx is an i8*, vsp and rflags are i64* and every
+access casts to a pointer of the width it loads or stores, which is a no-op with the opaque pointers of 15 and 16.
+the target machine and codegen APIs used by compile_x86 changed in 17
 */
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdio>
 #include <memory>
+#include <string>
 #include <variant>
+#include <vector>
 #include <vmctx.hpp>
 #include <vmprofiles.hpp>
 
+#include <llvm/Config/llvm-config.h>
 #include <llvm/IR/Attributes.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
@@ -38,6 +55,10 @@ This project no longer uses llvm, although it is better than vtil
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
 
+#if LLVM_VERSION_MAJOR < 14 || LLVM_VERSION_MAJOR > 16
+#error "lifter_llvm needs LLVM 14, 15 or 16"
+#endif
+
 using namespace llvm;
 
 namespace llvm
@@ -47,4 +68,511 @@ namespace llvm
     extern "C" void LLVMInitializeX86TargetMC();
     extern "C" void LLVMInitializeX86AsmParser();
     extern "C" void LLVMInitializeX86AsmPrinter();
-} // namespace llvm
\ No newline at end of file
+} // namespace llvm
+namespace lifters
+{
+    namespace lifter_llvm
+    {
+        class lift_context_t
+        {
+          public:
+            lift_context_t( llvm::Function *function, llvm::IRBuilder<> &builder )
+                : function( function ), builder( builder ), vmctx( function->getArg( 0 ) ), vsp( function->getArg( 1 ) ),
+                  rflags( function->getArg( 2 ) )
+            {
+            }
+
+            llvm::Function *function;
+            llvm::IRBuilder<> &builder;
+
+            llvm::Value *vmctx;
+            llvm::Value *vsp;
+            llvm::Value *rflags;
+
+            llvm::Type *int_ty( unsigned bits )
+            {
+                return builder.getIntNTy( bits );
+            }
+
+            llvm::Value *imm( std::uint64_t value, unsigned bits )
+            {
+                return builder.getIntN( bits, value );
+            }
+
+            // pointer to an integer of bits, plain ptr with opaque pointers
+            llvm::Type *ptr_ty( unsigned bits )
+            {
+                return int_ty( bits )->getPointerTo();
+            }
+
+            // vmprotect keeps the virtual stack aligned to two bytes, bytes take up a word
+            static unsigned slot_size( unsigned bits )
+            {
+                return std::max( 2u, bits / 8 );
+            }
+
+            llvm::Value *load_vsp()
+            {
+                return builder.CreateLoad( int_ty( 64 ), vsp );
+            }
+
+            void push( llvm::Value *value )
+            {
+                const auto bits = value->getType()->getIntegerBitWidth();
+                auto sp = builder.CreateSub( load_vsp(), imm( slot_size( bits ), 64 ) );
+                builder.CreateStore( sp, vsp );
+                builder.CreateStore( value, builder.CreateIntToPtr( sp, ptr_ty( bits ) ) );
+            }
+
+            llvm::Value *pop( unsigned bits )
+            {
+                auto sp = load_vsp();
+                auto value = builder.CreateLoad( int_ty( bits ), builder.CreateIntToPtr( sp, ptr_ty( bits ) ) );
+                builder.CreateStore( builder.CreateAdd( sp, imm( slot_size( bits ), 64 ) ), vsp );
+                return value;
+            }
+
+            void pushf()
+            {
+                push( builder.CreateLoad( int_ty( 64 ), rflags ) );
+            }
+
+            void popf()
+            {
+                builder.CreateStore( pop( 64 ), rflags );
+            }
+
+            llvm::Value *context_ptr( std::uint64_t context_offset, unsigned bits )
+            {
+                return builder.CreatePointerCast(
+                    builder.CreateConstInBoundsGEP1_64( builder.getInt8Ty(), vmctx, context_offset ), ptr_ty( bits ) );
+            }
+
+            llvm::Value *load_context( std::uint64_t context_offset, unsigned bits )
+            {
+                return builder.CreateLoad( int_ty( bits ), context_ptr( context_offset, bits ) );
+            }
+
+            void store_context( std::uint64_t context_offset, llvm::Value *value )
+            {
+                builder.CreateStore( value, context_ptr( context_offset, value->getType()->getIntegerBitWidth() ) );
+            }
+
+            llvm::Value *memory_ptr( llvm::Value *address, unsigned bits )
+            {
+                return builder.CreateIntToPtr( address, ptr_ty( bits ) );
+            }
+        };
+
+        using lift_fn_t = void ( * )( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                      vmp2::v3::code_block_t *code_blk );
+
+        struct lifter_t
+        {
+            vm::handler::mnemonic_t mnemonic;
+            lift_fn_t func;
+        };
+
+        // same families as lifter_vtil, N is the width of the operand in bits
+
+        // the native shifts mask the count to 5 bits, 6 for 64 bit operands. shifting an llvm integer by its width
+        // or more is poison, so the count is always masked and 8 and 16 bit operands select zero for counts of N
+        // or more like the native shift does
+        template < unsigned N > llvm::Value *shift_count( lift_context_t *ctx, llvm::Value *count )
+        {
+            return ctx->builder.CreateAnd( count, ctx->imm( N == 64 ? 63 : 31, N ) );
+        }
+
+        template < unsigned N >
+        llvm::Value *clear_out_of_range( lift_context_t *ctx, llvm::Value *count, llvm::Value *shifted )
+        {
+            if ( N >= 32 )
+                return shifted;
+
+            auto &builder = ctx->builder;
+            return builder.CreateSelect( builder.CreateICmpUGE( count, ctx->imm( N, N ) ), ctx->imm( 0, N ), shifted );
+        }
+
+        template < unsigned N >
+        void lift_lconst( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            ctx->push( ctx->imm( vinstr->operand.imm.u, N ) );
+        }
+
+        // lconst variants that extend an immediate of From bits to N bits
+        template < unsigned N, unsigned From, bool Signed >
+        void lift_lconst_extend( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto value = ctx->imm( vinstr->operand.imm.u, From );
+            ctx->push( Signed ? ctx->builder.CreateSExt( value, ctx->int_ty( N ) )
+                              : ctx->builder.CreateZExt( value, ctx->int_ty( N ) ) );
+        }
+
+        template < unsigned N >
+        void lift_sreg( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            ctx->store_context( vinstr->operand.imm.u, ctx->pop( N ) );
+        }
+
+        template < unsigned N >
+        void lift_lreg( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            ctx->push( ctx->load_context( vinstr->operand.imm.u, N ) );
+        }
+
+        template < unsigned N >
+        void lift_add( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto t0 = ctx->pop( N );
+            auto t1 = ctx->pop( N );
+            ctx->push( ctx->builder.CreateAdd( t1, t0 ) );
+            ctx->pushf();
+        }
+
+        template < unsigned N >
+        void lift_nand( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto t0 = ctx->pop( N );
+            auto t1 = ctx->pop( N );
+            ctx->push( ctx->builder.CreateAnd( ctx->builder.CreateNot( t0 ), ctx->builder.CreateNot( t1 ) ) );
+            ctx->pushf();
+        }
+
+        template < unsigned N >
+        void lift_read( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto address = ctx->pop( 64 );
+            ctx->push( ctx->builder.CreateLoad( ctx->int_ty( N ), ctx->memory_ptr( address, N ) ) );
+        }
+
+        template < unsigned N >
+        void lift_write( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto address = ctx->pop( 64 );
+            auto value = ctx->pop( N );
+            ctx->builder.CreateStore( value, ctx->memory_ptr( address, N ) );
+        }
+
+        template < unsigned N >
+        void lift_shr( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto t0 = ctx->pop( N );
+            auto count = shift_count< N >( ctx, ctx->pop( N ) );
+            ctx->push( clear_out_of_range< N >( ctx, count, ctx->builder.CreateLShr( t0, count ) ) );
+            ctx->pushf();
+        }
+
+        template < unsigned N >
+        void lift_shl( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto t0 = ctx->pop( N );
+            auto count = shift_count< N >( ctx, ctx->pop( N ) );
+            ctx->push( clear_out_of_range< N >( ctx, count, ctx->builder.CreateShl( t0, count ) ) );
+            ctx->pushf();
+        }
+
+        template < unsigned N >
+        void lift_shld( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto t0 = ctx->pop( N );
+            auto t1 = ctx->pop( N );
+            auto t2 = ctx->pop( N );
+
+            // t0 << t2 | t1 >> ( N - t2 ), t0 if the count is 0. fshl takes the count modulo N, which for 32 bit
+            // operands is the native mask
+            auto &builder = ctx->builder;
+            ctx->push( builder.CreateIntrinsic( llvm::Intrinsic::fshl, { ctx->int_ty( N ) },
+                                                { t0, t1, shift_count< N >( ctx, t2 ) } ) );
+            ctx->pushf();
+        }
+
+        template < unsigned N >
+        void lift_shrd( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto t0 = ctx->pop( N );
+            auto t1 = ctx->pop( N );
+            auto t2 = ctx->pop( N );
+
+            // t0 >> t2 | t1 << ( N - t2 ), t0 if the count is 0. fshr( hi, lo ) returns lo for a count of 0, so t1
+            // is the high half
+            auto &builder = ctx->builder;
+            ctx->push( builder.CreateIntrinsic( llvm::Intrinsic::fshr, { ctx->int_ty( N ) },
+                                                { t1, t0, shift_count< N >( ctx, t2 ) } ) );
+            ctx->pushf();
+        }
+
+        template < unsigned N >
+        void lift_div( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto d = ctx->pop( N );
+            auto a = ctx->pop( N );
+            auto c = ctx->pop( N );
+
+            // ( d:a ) / c and ( d:a ) % c
+            auto &builder = ctx->builder;
+            auto wide = ctx->int_ty( N * 2 );
+            auto dividend = builder.CreateOr( builder.CreateShl( builder.CreateZExt( d, wide ), N ),
+                                              builder.CreateZExt( a, wide ) );
+            auto divisor = builder.CreateZExt( c, wide );
+
+            // the native div raises #DE for a zero divisor or a quotient wider than N bits, udiv is undefined for the
+            // first and the truncation would hide the second. the quotient fits exactly when d < c, which also rules
+            // out c = 0
+            auto fault = llvm::BasicBlock::Create( builder.getContext(), "div_fault", ctx->function );
+            auto next = llvm::BasicBlock::Create( builder.getContext(), "div", ctx->function );
+            builder.CreateCondBr( builder.CreateICmpUGE( d, c ), fault, next );
+
+            builder.SetInsertPoint( fault );
+            builder.CreateIntrinsic( llvm::Intrinsic::trap, {}, {} );
+            builder.CreateUnreachable();
+
+            builder.SetInsertPoint( next );
+            ctx->push( builder.CreateTrunc( builder.CreateUDiv( dividend, divisor ), ctx->int_ty( N ) ) );
+            ctx->push( builder.CreateTrunc( builder.CreateURem( dividend, divisor ), ctx->int_ty( N ) ) );
+            ctx->pushf();
+        }
+
+        template < unsigned N >
+        void lift_mul( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto d = ctx->pop( N );
+            auto a = ctx->pop( N );
+
+            auto &builder = ctx->builder;
+            auto wide = ctx->int_ty( N * 2 );
+            auto product = builder.CreateMul( builder.CreateZExt( a, wide ), builder.CreateZExt( d, wide ) );
+
+            ctx->push( builder.CreateTrunc( product, ctx->int_ty( N ) ) );
+            ctx->push( builder.CreateTrunc( builder.CreateLShr( product, N ), ctx->int_ty( N ) ) );
+            ctx->pushf();
+        }
+
+        constexpr lifter_t lconstbzxq = { vm::handler::LCONSTBSXQ, &lift_lconst_extend< 64, 8, true > };
+        constexpr lifter_t lconstq = { vm::handler::LCONSTQ, &lift_lconst< 64 > };
+        constexpr lifter_t lconstdw = { vm::handler::LCONSTDW, &lift_lconst< 32 > };
+        constexpr lifter_t lconstw = { vm::handler::LCONSTW, &lift_lconst< 16 > };
+        constexpr lifter_t lconstb2w = { vm::handler::LCONSTB2W, &lift_lconst_extend< 16, 8, true > };
+        constexpr lifter_t lconstbzxw = { vm::handler::LCONSTBZXW, &lift_lconst_extend< 16, 8, false > };
+        constexpr lifter_t lconstwsxq = { vm::handler::LCONSTWSXQ, &lift_lconst_extend< 64, 16, true > };
+
+        constexpr lifter_t sregq = { vm::handler::SREGQ, &lift_sreg< 64 > };
+        constexpr lifter_t sregdw = { vm::handler::SREGDW, &lift_sreg< 32 > };
+        constexpr lifter_t sregw = { vm::handler::SREGW, &lift_sreg< 16 > };
+        constexpr lifter_t sregb = { vm::handler::SREGB, &lift_sreg< 8 > };
+
+        constexpr lifter_t lregq = { vm::handler::LREGQ, &lift_lreg< 64 > };
+        constexpr lifter_t lregdw = { vm::handler::LREGDW, &lift_lreg< 32 > };
+        constexpr lifter_t lregw = { vm::handler::LREGW, &lift_lreg< 16 > };
+        constexpr lifter_t lregb = { vm::handler::LREGB, &lift_lreg< 8 > };
+
+        constexpr lifter_t addq = { vm::handler::ADDQ, &lift_add< 64 > };
+        constexpr lifter_t adddw = { vm::handler::ADDDW, &lift_add< 32 > };
+        constexpr lifter_t addw = { vm::handler::ADDW, &lift_add< 16 > };
+        constexpr lifter_t addb = { vm::handler::ADDB, &lift_add< 8 > };
+
+        constexpr lifter_t nandq = { vm::handler::NANDQ, &lift_nand< 64 > };
+        constexpr lifter_t nanddw = { vm::handler::NANDDW, &lift_nand< 32 > };
+        constexpr lifter_t nandw = { vm::handler::NANDW, &lift_nand< 16 > };
+        constexpr lifter_t nandb = { vm::handler::NANDB, &lift_nand< 8 > };
+
+        constexpr lifter_t readq = { vm::handler::READQ, &lift_read< 64 > };
+        constexpr lifter_t readdw = { vm::handler::READDW, &lift_read< 32 > };
+        constexpr lifter_t readw = { vm::handler::READW, &lift_read< 16 > };
+        constexpr lifter_t readb = { vm::handler::READB, &lift_read< 8 > };
+
+        constexpr lifter_t writeq = { vm::handler::WRITEQ, &lift_write< 64 > };
+        constexpr lifter_t writedw = { vm::handler::WRITEDW, &lift_write< 32 > };
+        constexpr lifter_t writew = { vm::handler::WRITEW, &lift_write< 16 > };
+        constexpr lifter_t writeb = { vm::handler::WRITEB, &lift_write< 8 > };
+
+        constexpr lifter_t shrq = { vm::handler::SHRQ, &lift_shr< 64 > };
+        constexpr lifter_t shrdw = { vm::handler::SHRDW, &lift_shr< 32 > };
+        constexpr lifter_t shrw = { vm::handler::SHRW, &lift_shr< 16 > };
+        constexpr lifter_t shrb = { vm::handler::SHRB, &lift_shr< 8 > };
+
+        constexpr lifter_t shlq = { vm::handler::SHLQ, &lift_shl< 64 > };
+        constexpr lifter_t shldw = { vm::handler::SHLDW, &lift_shl< 32 > };
+        constexpr lifter_t shlw = { vm::handler::SHLW, &lift_shl< 16 > };
+        constexpr lifter_t shlb = { vm::handler::SHLB, &lift_shl< 8 > };
+
+        constexpr lifter_t shlddw = { vm::handler::SHLDDW, &lift_shld< 32 > };
+        constexpr lifter_t shrddw = { vm::handler::SHRDDW, &lift_shrd< 32 > };
+
+        constexpr lifter_t divq = { vm::handler::DIVQ, &lift_div< 64 > };
+        constexpr lifter_t divdw = { vm::handler::DIVDW, &lift_div< 32 > };
+        constexpr lifter_t divw = { vm::handler::DIVW, &lift_div< 16 > };
+
+        constexpr lifter_t mulq = { vm::handler::MULQ, &lift_mul< 64 > };
+        constexpr lifter_t muldw = { vm::handler::MULDW, &lift_mul< 32 > };
+        constexpr lifter_t mulw = { vm::handler::MULW, &lift_mul< 16 > };
+
+        constexpr lifter_t pushvspq = { vm::handler::PUSHVSPQ,
+                                        []( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                            vmp2::v3::code_block_t *code_blk ) { ctx->push( ctx->load_vsp() ); } };
+
+        constexpr lifter_t popvspq = { vm::handler::POPVSPQ,
+                                       []( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                           vmp2::v3::code_block_t *code_blk )
+                                       { ctx->builder.CreateStore( ctx->pop( 64 ), ctx->vsp ); } };
+
+        constexpr lifter_t lflagsq = { vm::handler::LFLAGSQ,
+                                       []( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                           vmp2::v3::code_block_t *code_blk ) { ctx->popf(); } };
+
+        constexpr lifter_t rdtsc = { vm::handler::RDTSC,
+                                     []( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                         vmp2::v3::code_block_t *code_blk )
+                                     {
+                                         auto &builder = ctx->builder;
+                                         auto tsc = builder.CreateIntrinsic( llvm::Intrinsic::readcyclecounter, {}, {} );
+
+                                         // [rsp + 4] := edx
+                                         // [rsp] := eax
+                                         ctx->push( builder.CreateTrunc( tsc, ctx->int_ty( 32 ) ) );
+                                         ctx->push( builder.CreateTrunc( builder.CreateLShr( tsc, 32 ), ctx->int_ty( 32 ) ) );
+                                     } };
+
+        constexpr lifter_t LiftersArray[] = {
+            lconstbzxq, lconstq, lconstdw, lconstbzxw, lconstwsxq, lconstw, lconstb2w, sregq,  sregw,  sregdw,   sregb,
+            addq,       adddw,   addw,     addb,       lregq,      lregdw,  lregw,     lregb,  pushvspq, popvspq, readq,
+            readw,      readdw,  readb,    writeq,     writedw,    writew,  writeb,    nandq,  nanddw, nandw,    nandb,
+            shrq,       shrdw,   shrw,     shrb,       shlq,       shldw,   shlw,      shlb,   shlddw, shrddw,   lflagsq,
+            rdtsc,      divq,    divdw,    divw,       mulq,       muldw,   mulw,
+        };
+
+        constexpr std::size_t LiftersTableSize = []
+        {
+            std::size_t max_mnemonic = 0;
+            for ( const auto &lifter : LiftersArray )
+                max_mnemonic = std::max< std::size_t >( max_mnemonic, lifter.mnemonic );
+            return max_mnemonic + 1;
+        }();
+
+        constexpr std::array< lift_fn_t, LiftersTableSize > LiftersTable = []
+        {
+            std::array< lift_fn_t, LiftersTableSize > table{};
+            for ( const auto &lifter : LiftersArray )
+                table[ lifter.mnemonic ] = lifter.func;
+            return table;
+        }();
+
+        inline lift_fn_t get_lifter( vm::handler::mnemonic_t mnemonic )
+        {
+            const auto idx = static_cast< std::size_t >( mnemonic );
+            return idx < LiftersTable.size() ? LiftersTable[ idx ] : nullptr;
+        }
+
+        // declares void @vmp_<vip>( ptr %vmctx, ptr %vsp, ptr %rflags ) and lifts the code block into it.
+        // returns nullptr and erases the function if a virtual instruction has no lifter
+        inline llvm::Function *lift( llvm::Module &module, vmp2::v3::code_block_t *code_blk )
+        {
+            auto &context = module.getContext();
+            auto function_ty = llvm::FunctionType::get(
+                llvm::Type::getVoidTy( context ),
+                { llvm::Type::getInt8PtrTy( context ), llvm::Type::getInt64PtrTy( context ),
+                  llvm::Type::getInt64PtrTy( context ) },
+                false );
+
+            char name[ 32 ];
+            std::snprintf( name, sizeof( name ), "vmp_%llx", static_cast< unsigned long long >( code_blk->vip_begin ) );
+
+            auto function = llvm::Function::Create( function_ty, llvm::Function::ExternalLinkage, name, module );
+            function->getArg( 0 )->setName( "vmctx" );
+            function->getArg( 1 )->setName( "vsp" );
+            function->getArg( 2 )->setName( "rflags" );
+
+            // the three pointers never alias each other
+            for ( auto arg = 0u; arg < 3; ++arg )
+                function->addParamAttr( arg, llvm::Attribute::NoAlias );
+
+            llvm::IRBuilder<> builder( llvm::BasicBlock::Create( context, "entry", function ) );
+            lift_context_t ctx( function, builder );
+
+            for ( auto idx = 0u; idx < code_blk->vinstr_count; ++idx )
+            {
+                auto vinstr = &code_blk->vinstr[ idx ];
+                const auto func = get_lifter( vinstr->mnemonic_t );
+                if ( !func )
+                {
+                    function->eraseFromParent();
+                    return nullptr;
+                }
+
+                func( &ctx, vinstr, code_blk );
+            }
+
+            builder.CreateRetVoid();
+            return function;
+        }
+
+        enum class opt_level_t
+        {
+            O1,
+            O2,
+        };
+
+        inline void optimize( llvm::Module &module, opt_level_t level )
+        {
+            llvm::LoopAnalysisManager lam;
+            llvm::FunctionAnalysisManager fam;
+            llvm::CGSCCAnalysisManager cgam;
+            llvm::ModuleAnalysisManager mam;
+
+            llvm::PassBuilder pb;
+            pb.registerModuleAnalyses( mam );
+            pb.registerCGSCCAnalyses( cgam );
+            pb.registerFunctionAnalyses( fam );
+            pb.registerLoopAnalyses( lam );
+            pb.crossRegisterProxies( lam, fam, cgam, mam );
+
+            auto mpm = pb.buildPerModuleDefaultPipeline( level == opt_level_t::O1 ? llvm::OptimizationLevel::O1
+                                                                                : llvm::OptimizationLevel::O2 );
+            mpm.run( module, mam );
+        }
+
+        // compiles the module to a native x86-64 object file, returns an empty vector on failure
+        inline std::vector< std::uint8_t > compile_x86( llvm::Module &module )
+        {
+            static const bool initialized = []
+            {
+                LLVMInitializeX86TargetInfo();
+                LLVMInitializeX86Target();
+                LLVMInitializeX86TargetMC();
+                LLVMInitializeX86AsmParser();
+                LLVMInitializeX86AsmPrinter();
+                return true;
+            }();
+            ( void )initialized;
+
+            const std::string triple = "x86_64-pc-windows-msvc";
+            std::string error;
+            const auto target = llvm::TargetRegistry::lookupTarget( triple, error );
+            if ( !target )
+                return {};
+
+            std::unique_ptr< llvm::TargetMachine > machine( target->createTargetMachine(
+                triple, "x86-64", "", llvm::TargetOptions(), llvm::Reloc::PIC_,
+#if LLVM_VERSION_MAJOR >= 16
+                std::nullopt,
+#else
+                llvm::None,
+#endif
+                llvm::CodeGenOpt::Aggressive ) );
+            if ( !machine )
+                return {};
+
+            module.setTargetTriple( triple );
+            module.setDataLayout( machine->createDataLayout() );
+
+            llvm::SmallVector< char, 0 > object;
+            llvm::raw_svector_ostream stream( object );
+
+            llvm::legacy::PassManager pm;
+            if ( machine->addPassesToEmitFile( pm, stream, nullptr, llvm::CGFT_ObjectFile ) )
+                return {};
+
+            pm.run( module );
+            return { object.begin(), object.end() };
+        }
+    }; // namespace lifter_llvm
+} // namespace lifters
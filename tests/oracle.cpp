@@ -0,0 +1,97 @@
+// differential test of every lifter against the interpreter, see vtil/oracle.hpp. every handler and every shift
+// count workload is lifted with each set of options below and run on random inputs, and incremental lifting is
+// compared with a full lift. exits with 1 if a block does not match, blocks that cannot be checked are only listed
+#include <cstdio>
+#include <cstdlib>
+
+#include "../vtil/oracle.hpp"
+
+namespace
+{
+    using namespace lifters::lifter_vtil;
+
+    struct options_t
+    {
+        const char *name;
+        lift_options_t options;
+    };
+
+    lift_options_t make_options( bool stack_to_temporaries, bool lazy_flags, bool recognize_idioms,
+                                 bool fold_constants )
+    {
+        lift_options_t options;
+        options.stack_to_temporaries = stack_to_temporaries;
+        options.lazy_flags = lazy_flags;
+        options.recognize_idioms = recognize_idioms;
+        options.fold_constants = fold_constants;
+        return options;
+    }
+
+    const char *verdict_name( oracle::verdict_t verdict )
+    {
+        switch ( verdict )
+        {
+        case oracle::verdict_t::match:
+            return "match";
+        case oracle::verdict_t::mismatch:
+            return "mismatch";
+        case oracle::verdict_t::fault:
+            return "fault";
+        default:
+            return "unsupported";
+        }
+    }
+
+    // prints every report that is not a match, returns the number of mismatches
+    std::size_t print( const char *options, const std::vector< oracle::report_t > &reports )
+    {
+        std::size_t mismatches = 0;
+        for ( const auto &report : reports )
+        {
+            if ( report.verdict == oracle::verdict_t::match )
+                continue;
+
+            std::printf( "%-12s %-24s %s\n", options, report.name.c_str(), verdict_name( report.verdict ) );
+            if ( report.verdict == oracle::verdict_t::mismatch )
+                ++mismatches;
+        }
+        return mismatches;
+    }
+} // namespace
+
+int main( int argc, char **argv )
+{
+    const auto seed = argc > 1 ? static_cast< std::uint32_t >( std::strtoul( argv[ 1 ], nullptr, 0 ) ) : 0u;
+
+    // coalesce_context needs the liveness of a whole routine, single blocks have nothing to coalesce
+    const options_t option_sets[] = {
+        { "default", make_options( false, false, false, false ) },
+        { "temporaries", make_options( true, false, false, false ) },
+        { "lazy_flags", make_options( false, true, false, false ) },
+        { "idioms", make_options( true, true, true, false ) },
+        { "fold", make_options( true, true, false, true ) },
+        { "all", make_options( true, true, true, true ) },
+    };
+
+    std::size_t mismatches = 0;
+    for ( const auto &set : option_sets )
+    {
+        mismatches += print( set.name, oracle::check_handlers( set.options, 4, 64, seed ) );
+        mismatches += print( set.name, oracle::check_shift_counts( set.options, 4, seed ) );
+
+        for ( const auto &name : oracle::check_incremental( set.options, seed ) )
+        {
+            std::printf( "%-12s %-24s %s\n", set.name, ( "incremental_" + name ).c_str(), "mismatch" );
+            ++mismatches;
+        }
+    }
+
+    for ( const auto &name : oracle::check_shift_folding( seed ) )
+    {
+        std::printf( "%-12s %-24s %s\n", "folding", name.c_str(), "mismatch" );
+        ++mismatches;
+    }
+
+    std::printf( "%zu mismatches\n", mismatches );
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include <vmctx.hpp>
+
+#include "../common/pe.hpp"
+#include "parallel.hpp"
+
+namespace lifters
+{
+    namespace lifter_vtil
+    {
+        namespace batch
+        {
+            struct entry_result_t
+            {
+                vm_entry_t entry;
+
+                // null when the vm context of its vm_enter could not be initialized or no code blocks were found
+                std::unique_ptr< vtil::routine > rtn;
+
+                std::size_t blocks = 0;
+                std::size_t vinstrs = 0;
+                std::size_t failed = 0;
+            };
+
+            struct stats_t
+            {
+                std::size_t entries = 0;
+
+                // one per distinct vm_enter, shared by every entry calling it
+                std::size_t contexts = 0;
+                std::size_t failed_contexts = 0;
+
+                std::size_t blocks = 0;
+                std::size_t vinstrs = 0;
+                std::size_t failed = 0;
+
+                double discover_seconds = 0.0;
+                double lift_seconds = 0.0;
+
+                double blocks_per_second() const
+                {
+                    return lift_seconds > 0.0 ? blocks / lift_seconds : 0.0;
+                }
+
+                double vinstrs_per_second() const
+                {
+                    return lift_seconds > 0.0 ? vinstrs / lift_seconds : 0.0;
+                }
+            };
+
+            inline void write_json( std::ostream &out, const stats_t &stats )
+            {
+                out << "{\"entries\":" << stats.entries << ",\"contexts\":" << stats.contexts
+                    << ",\"failed_contexts\":" << stats.failed_contexts << ",\"blocks\":" << stats.blocks
+                    << ",\"vinstrs\":" << stats.vinstrs << ",\"failed\":" << stats.failed
+                    << ",\"discover_seconds\":" << stats.discover_seconds << ",\"lift_seconds\":" << stats.lift_seconds
+                    << ",\"blocks_per_second\":" << stats.blocks_per_second()
+                    << ",\"vinstrs_per_second\":" << stats.vinstrs_per_second() << "}\n";
+            }
+
+            // returns the code blocks of a vm entry. the blocks must stay alive until lift returns. the vm context
+            // is the one shared by every entry calling the same vm_enter, its handler table is already profiled.
+            // called on the calling thread, one entry after the other
+            using discover_fn_t =
+                std::function< std::vector< vmp2::v3::code_block_t * >( const vm_entry_t &entry, vm::ctx_t &vmctx ) >;
+
+            // lifts every vm entry of a pe image in one go. the image is mapped and laid out once, every entry
+            // calling the same vm_enter shares one vm context, so its handlers are only profiled and mapped to
+            // mnemonics the first time. the code blocks of every entry are then lifted together on one pool
+            class lifter_t
+            {
+              public:
+                explicit lifter_t( lift_options_t options = {}, unsigned thread_count = default_thread_count() )
+                    : options( options ), thread_count( thread_count )
+                {
+                }
+
+                bool open( const char *path )
+                {
+                    contexts.clear();
+                    if ( !file.open( path ) || !image.load( file ) )
+                        return false;
+
+                    // the virtual layout is a copy, the file is not needed anymore
+                    file.close();
+                    return true;
+                }
+
+                const pe_image_t &pe() const
+                {
+                    return image;
+                }
+
+                std::vector< vm_entry_t > entries() const
+                {
+                    return image.find_vm_entries();
+                }
+
+                // the vm context of every entry calling vm_enter_rva, initialized with the first of them. null if
+                // it fails to initialize, the failure is remembered as well
+                vm::ctx_t *context( const vm_entry_t &entry )
+                {
+                    auto [ it, inserted ] = contexts.try_emplace( entry.vm_enter_rva );
+                    if ( inserted )
+                    {
+                        auto vmctx = std::make_unique< vm::ctx_t >( reinterpret_cast< std::uintptr_t >( image.data() ),
+                                                                    image.preferred_base(), image.size(), entry.rva );
+                        if ( vmctx->init() )
+                            it->second = std::move( vmctx );
+                    }
+
+                    return it->second.get();
+                }
+
+                std::vector< entry_result_t > lift( const std::vector< vm_entry_t > &entries, const discover_fn_t &discover,
+                                                    stats_t *stats = nullptr )
+                {
+                    using clock = std::chrono::steady_clock;
+
+                    std::vector< entry_result_t > results( entries.size() );
+                    std::deque< context_liveness_t > liveness;
+                    std::vector< lift_task_t > tasks;
+                    std::vector< std::size_t > owners;
+                    stats_t local;
+
+                    const auto discover_begin = clock::now();
+                    for ( std::size_t idx = 0; idx < entries.size(); ++idx )
+                    {
+                        auto &result = results[ idx ];
+                        result.entry = entries[ idx ];
+
+                        const auto vmctx = context( result.entry );
+                        if ( !vmctx )
+                            continue;
+
+                        const auto code_blks = discover( result.entry, *vmctx );
+                        if ( code_blks.empty() )
+                            continue;
+
+                        auto &routine_liveness = liveness.emplace_back();
+                        if ( options.coalesce_context )
+                            routine_liveness.analyze( code_blks );
+
+                        // code blocks discovered twice are only lifted and counted once
+                        const auto first = tasks.size();
+                        result.rtn.reset( vtil::basic_block::begin( code_blks.front()->vip_begin )->owner );
+                        add_tasks( tasks, result.rtn.get(), code_blks, &routine_liveness );
+
+                        for ( auto task = first; task < tasks.size(); ++task )
+                        {
+                            owners.push_back( idx );
+                            ++result.blocks;
+                            result.vinstrs += tasks[ task ].code_blk->vinstr_count;
+                        }
+                    }
+                    local.discover_seconds = std::chrono::duration< double >( clock::now() - discover_begin ).count();
+
+                    std::vector< std::uint8_t > failed;
+
+                    const auto lift_begin = clock::now();
+                    lift_parallel( tasks, options, thread_count, &failed );
+                    local.lift_seconds = std::chrono::duration< double >( clock::now() - lift_begin ).count();
+
+                    for ( std::size_t idx = 0; idx < tasks.size(); ++idx )
+                        results[ owners[ idx ] ].failed += failed[ idx ];
+
+                    local.entries = entries.size();
+                    for ( const auto &result : results )
+                    {
+                        local.blocks += result.blocks;
+                        local.vinstrs += result.vinstrs;
+                        local.failed += result.failed;
+                    }
+
+                    for ( const auto &[ rva, vmctx ] : contexts )
+                    {
+                        ++local.contexts;
+                        if ( !vmctx )
+                            ++local.failed_contexts;
+                    }
+
+                    if ( stats )
+                        *stats = local;
+                    return results;
+                }
+
+                // every vm entry found in the image
+                std::vector< entry_result_t > lift( const discover_fn_t &discover, stats_t *stats = nullptr )
+                {
+                    return lift( entries(), discover, stats );
+                }
+
+              private:
+                lift_options_t options;
+                unsigned thread_count;
+
+                mapped_file_t file;
+                pe_image_t image;
+
+                // by vm_enter rva, null if it failed to initialize
+                std::map< std::uint32_t, std::unique_ptr< vm::ctx_t > > contexts;
+            };
+        } // namespace batch
+    } // namespace lifter_vtil
+} // namespace lifters
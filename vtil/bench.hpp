@@ -0,0 +1,265 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../common/arena.hpp"
+#include "../common/synthetic.hpp"
+#include "vtil.hpp"
+
+// benchmarks for the vtil lifters over synthetic virtual instruction streams, every result is written as one json
+// object per line so runs can be diffed and tracked by scripts.
+//
+// allocation counts are only reported if LIFTERS_BENCH_COUNT_ALLOCATIONS is defined in exactly one translation unit
+// before including this header, it replaces the global operator new/delete with counting versions
+
+namespace lifters
+{
+    namespace lifter_vtil
+    {
+        namespace bench
+        {
+            inline std::atomic< std::size_t > allocation_count = 0;
+
+            struct config_t
+            {
+                lift_options_t options = {};
+
+                // times every workload is lifted, and the number of handler sequences per synthetic block
+                std::size_t iterations = 200;
+                std::size_t repeat = 32;
+
+                // optimizing is orders of magnitude slower than lifting, it is measured on fewer blocks
+                std::size_t optimizer_iterations = 4;
+
+                // allocate the lifter state from an arena_t that is reset after every block
+                bool arena = false;
+            };
+
+            struct result_t
+            {
+                std::string name;
+                std::size_t vinstrs = 0;
+                std::size_t blocks = 0;
+                std::size_t emitted = 0;
+                std::size_t allocations = 0;
+                std::size_t arena_allocations = 0;
+                double lift_seconds = 0;
+                double optimize_seconds = 0;
+                std::size_t optimized_blocks = 0;
+            };
+
+            inline void write_json( std::ostream &out, const result_t &result, const config_t &config )
+            {
+                const auto per_vinstr = [ & ]( double value ) { return result.vinstrs ? value / result.vinstrs : 0.0; };
+
+                out << "{\"benchmark\":\"" << result.name << "\",\"options\":" << config.options.key()
+                    << ",\"arena\":" << ( config.arena ? "true" : "false" )
+                    << ",\"vinstrs\":" << result.vinstrs << ",\"blocks\":" << result.blocks
+                    << ",\"vinstrs_per_second\":" << ( result.lift_seconds ? result.vinstrs / result.lift_seconds : 0.0 )
+                    << ",\"emitted_per_vinstr\":" << per_vinstr( static_cast< double >( result.emitted ) )
+                    << ",\"allocations_per_block\":"
+                    << ( result.blocks ? static_cast< double >( result.allocations ) / result.blocks : 0.0 )
+                    << ",\"arena_allocations_per_block\":"
+                    << ( result.blocks ? static_cast< double >( result.arena_allocations ) / result.blocks : 0.0 )
+                    << ",\"optimize_seconds_per_block\":"
+                    << ( result.optimized_blocks ? result.optimize_seconds / result.optimized_blocks : 0.0 ) << "}\n";
+            }
+
+            inline result_t run_workload( const std::string &name, const std::vector< vm::instrs::virt_instr_t > &vinstrs,
+                                          const config_t &config )
+            {
+                using clock = std::chrono::steady_clock;
+
+                synthetic::code_block_buffer_t code_blk( vinstrs );
+                result_t result;
+                result.name = name;
+
+                arena_t arena;
+                const auto resource = config.arena ? &arena : std::pmr::get_default_resource();
+
+                for ( std::size_t iteration = 0; iteration < config.iterations; ++iteration )
+                {
+                    auto blk = vtil::basic_block::begin( 0 );
+
+                    const auto allocations = allocation_count.load();
+                    const auto begin = clock::now();
+                    {
+                        lift_context_t ctx( blk, config.options, resource );
+                        lift( &ctx, code_blk.get() );
+                    }
+                    result.lift_seconds += std::chrono::duration< double >( clock::now() - begin ).count();
+                    result.allocations += allocation_count.load() - allocations;
+                    result.arena_allocations += arena.allocation_count();
+                    arena.reset();
+
+                    result.vinstrs += vinstrs.size();
+                    result.emitted += blk->size();
+                    ++result.blocks;
+
+                    if ( iteration < config.optimizer_iterations )
+                    {
+                        LIFTERS_SPAN( "optimize_block", "optimize", iteration );
+                        const auto optimize_begin = clock::now();
+                        vtil::optimizer::apply_all( blk->owner );
+                        result.optimize_seconds += std::chrono::duration< double >( clock::now() - optimize_begin ).count();
+                        ++result.optimized_blocks;
+                    }
+
+                    delete blk->owner;
+                }
+
+                return result;
+            }
+
+            // a lifter the way the lifters were dispatched before LiftersTable: scanned for in an array and called
+            // through std::function
+            struct function_lifter_t
+            {
+                vm::handler::mnemonic_t mnemonic;
+                std::function< void( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                     vmp2::v3::code_block_t *code_blk ) >
+                    func;
+            };
+
+            // cost of finding the lifter of a virtual instruction, and of finding and calling it. linear_function is
+            // the original dispatch, a scan over std::function, linear scans the function pointers of LiftersArray
+            // and table indexes LiftersTable. the calls lift the same stream into a fresh block every pass, so
+            // only the dispatch differs between them
+            inline void run_dispatch( std::ostream &out, std::size_t lookups = 1 << 24, std::size_t calls = 1 << 20 )
+            {
+                using clock = std::chrono::steady_clock;
+
+                std::vector< function_lifter_t > functions;
+                for ( const auto &lifter : LiftersArray )
+                    functions.push_back( { lifter.mnemonic, lifter.func } );
+
+                std::mt19937 rng( 0 );
+                std::vector< vm::instrs::virt_instr_t > stream( 1 << 12 );
+                for ( auto &vinstr : stream )
+                {
+                    const auto mnemonic = functions[ rng() % functions.size() ].mnemonic;
+                    vinstr = synthetic::make_vinstr( mnemonic, ( rng() % 24 ) * 8, 8 );
+                }
+
+                synthetic::code_block_buffer_t code_blk( stream );
+
+                const auto measure_lookup = [ & ]( const char *name, auto &&find )
+                {
+                    std::uintptr_t checksum = 0;
+                    const auto begin = clock::now();
+                    for ( std::size_t idx = 0; idx < lookups; ++idx )
+                        checksum += reinterpret_cast< std::uintptr_t >(
+                            find( stream[ idx & ( stream.size() - 1 ) ].mnemonic_t ) );
+                    const auto seconds = std::chrono::duration< double >( clock::now() - begin ).count();
+
+                    out << "{\"benchmark\":\"dispatch_" << name << "\",\"lookups\":" << lookups
+                        << ",\"ns_per_lookup\":" << seconds * 1e9 / lookups << ",\"checksum\":" << checksum << "}\n";
+                };
+
+                const auto measure_call = [ & ]( const char *name, auto &&call )
+                {
+                    const auto begin = clock::now();
+                    for ( std::size_t done = 0; done < calls; )
+                    {
+                        auto blk = vtil::basic_block::begin( 0 );
+                        {
+                            lift_context_t ctx( blk );
+                            for ( std::size_t idx = 0; idx < stream.size() && done < calls; ++idx, ++done )
+                            {
+                                ctx.vinstr_index = idx;
+                                call( &ctx, &code_blk.get()->vinstr[ idx ], code_blk.get() );
+                            }
+                        }
+                        delete blk->owner;
+                    }
+                    const auto seconds = std::chrono::duration< double >( clock::now() - begin ).count();
+
+                    out << "{\"benchmark\":\"dispatch_call_" << name << "\",\"calls\":" << calls
+                        << ",\"ns_per_call\":" << seconds * 1e9 / calls << "}\n";
+                };
+
+                const auto find_function = [ & ]( vm::handler::mnemonic_t mnemonic ) -> const function_lifter_t *
+                {
+                    for ( const auto &lifter : functions )
+                        if ( lifter.mnemonic == mnemonic )
+                            return &lifter;
+                    return nullptr;
+                };
+
+                const auto find_linear = []( vm::handler::mnemonic_t mnemonic ) -> lift_fn_t
+                {
+                    for ( const auto &lifter : LiftersArray )
+                        if ( lifter.mnemonic == mnemonic )
+                            return lifter.func;
+                    return nullptr;
+                };
+
+                const auto find_table = []( vm::handler::mnemonic_t mnemonic ) { return get_lifter( mnemonic ); };
+
+                measure_lookup( "linear_function", find_function );
+                measure_lookup( "linear", find_linear );
+                measure_lookup( "table", find_table );
+
+                measure_call( "linear_function",
+                              [ & ]( auto *ctx, auto *vinstr, auto *code_blk )
+                              { find_function( vinstr->mnemonic_t )->func( ctx, vinstr, code_blk ); } );
+                measure_call( "linear",
+                              [ & ]( auto *ctx, auto *vinstr, auto *code_blk )
+                              { find_linear( vinstr->mnemonic_t )( ctx, vinstr, code_blk ); } );
+                measure_call( "table",
+                              [ & ]( auto *ctx, auto *vinstr, auto *code_blk )
+                              { find_table( vinstr->mnemonic_t )( ctx, vinstr, code_blk ); } );
+            }
+
+            // every handler in LiftersArray on its own, then the mixed workloads
+            inline void run_workloads( std::ostream &out, const config_t &config = {} )
+            {
+                for ( const auto &lifter : LiftersArray )
+                {
+                    const auto vinstrs = synthetic::handler_stream( lifter.mnemonic, config.repeat );
+                    write_json( out, run_workload( "handler_" + std::to_string( lifter.mnemonic ), vinstrs, config ),
+                                config );
+                }
+
+                for ( const auto &workload : synthetic::mixed_workloads( config.repeat ) )
+                    write_json( out, run_workload( workload.name, workload.vinstrs, config ), config );
+            }
+
+            inline void run_all( std::ostream &out, const config_t &config = {} )
+            {
+                run_dispatch( out );
+                run_workloads( out, config );
+            }
+        } // namespace bench
+    } // namespace lifter_vtil
+} // namespace lifters
+
+#ifdef LIFTERS_BENCH_COUNT_ALLOCATIONS
+void *operator new( std::size_t size )
+{
+    ++lifters::lifter_vtil::bench::allocation_count;
+    if ( auto ptr = std::malloc( size ? size : 1 ) )
+        return ptr;
+
+    throw std::bad_alloc();
+}
+
+void operator delete( void *ptr ) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete( void *ptr, std::size_t ) noexcept
+{
+    std::free( ptr );
+}
+#endif
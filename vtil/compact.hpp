@@ -0,0 +1,640 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/mapped_file.hpp"
+#include "lift_cache.hpp"
+
+namespace lifters
+{
+    namespace lifter_vtil
+    {
+        // compact binary format for lifted routines and lift cache entries. everything is stored in flat arrays of
+        // fixed size records that reference each other by index: blocks point into the instruction array,
+        // instructions into the operand array, operands into a table of interned registers and instructions into a
+        // table of instruction names. a file can be memory mapped and walked in place through view_t, nothing has
+        // to be deserialized before the first instruction is read.
+        //
+        // layout: file_header_t, then every section at the offset the header gives, aligned to 8 bytes
+        namespace compact
+        {
+            constexpr std::uint32_t file_magic = 0x42434c56; // "VLCB"
+            constexpr std::uint32_t file_version = 2;
+
+            constexpr std::uint32_t no_routine = ~0u;
+
+            struct section_t
+            {
+                std::uint64_t offset;
+                std::uint64_t count;
+            };
+
+            struct file_header_t
+            {
+                std::uint32_t magic;
+                std::uint32_t version;
+                std::uint32_t lifters_version;
+                std::uint32_t reserved;
+
+                section_t routines;
+                section_t blocks;
+                section_t successors;
+                section_t instructions;
+                section_t operands;
+                section_t registers;
+                section_t names;        // name_record_t
+                section_t strings;      // characters of the names, count is in bytes
+                section_t cache_entries;
+                section_t signatures;   // bytes of the cache keys, count is in bytes
+            };
+
+            struct routine_record_t
+            {
+                std::uint64_t entry_vip;
+                std::uint32_t first_block;
+                std::uint32_t block_count;
+            };
+
+            // blocks of a cache entry belong to no routine and have a vip of zero
+            struct block_record_t
+            {
+                std::uint64_t vip;
+                std::int64_t sp_offset;
+                std::uint64_t last_temporary_index;
+                std::uint32_t sp_index;
+                std::uint32_t first_instruction;
+                std::uint32_t instruction_count;
+                std::uint32_t first_successor;
+                std::uint32_t successor_count;
+                std::uint32_t routine;
+            };
+
+            struct instruction_record_t
+            {
+                std::uint64_t vip;
+                std::int64_t sp_offset;
+                std::uint32_t sp_index;
+                std::uint32_t first_operand;
+                std::uint16_t name;
+                std::uint8_t operand_count;
+                std::uint8_t sp_reset;
+                std::uint32_t reserved;
+            };
+
+            enum operand_kind_t : std::uint8_t
+            {
+                operand_immediate,
+                operand_register,
+            };
+
+            // registers carry their own width, immediates keep it here
+            struct operand_record_t
+            {
+                std::uint64_t imm;
+                std::uint32_t reg;
+                std::uint16_t bit_count;
+                std::uint8_t kind;
+                std::uint8_t reserved;
+            };
+
+            struct register_record_t
+            {
+                std::uint64_t flags;
+                std::uint64_t local_id;
+                std::int32_t bit_count;
+                std::int32_t bit_offset;
+                std::uint8_t architecture;
+                std::uint8_t reserved[ 7 ];
+            };
+
+            struct name_record_t
+            {
+                std::uint32_t offset;
+                std::uint32_t size;
+            };
+
+            struct cache_entry_record_t
+            {
+                std::uint64_t hash;
+                std::uint32_t signature_offset;
+                std::uint32_t signature_size;
+                std::uint32_t block;
+                std::uint8_t stage;
+                std::uint8_t reserved[ 3 ];
+            };
+
+            class writer_t
+            {
+              public:
+                void add( const vtil::routine *rtn )
+                {
+                    routine_record_t record = { rtn->entry_point ? rtn->entry_point->entry_vip : 0,
+                                                static_cast< std::uint32_t >( blocks.size() ), 0 };
+
+                    const auto routine = static_cast< std::uint32_t >( routines.size() );
+                    for ( const auto &[ vip, blk ] : rtn->explored_blocks )
+                    {
+                        auto &block = add_block( blk->begin(), blk->end(), blk->sp_offset, blk->sp_index,
+                                                 blk->last_temporary_index, routine );
+                        block.vip = vip;
+
+                        block.first_successor = static_cast< std::uint32_t >( successors.size() );
+                        for ( const auto next : blk->next )
+                            successors.push_back( next->entry_vip );
+                        block.successor_count = static_cast< std::uint32_t >( blk->next.size() );
+                    }
+
+                    record.block_count = static_cast< std::uint32_t >( blocks.size() ) - record.first_block;
+                    routines.push_back( record );
+                }
+
+                void add( const block_key_t &key, cache_stage_t stage, const cached_block_t &cached )
+                {
+                    add_block( cached.instructions.begin(), cached.instructions.end(), cached.sp_offset,
+                               cached.sp_index, cached.last_temporary_index, no_routine );
+
+                    cache_entry_record_t record = {};
+                    record.hash = key.hash;
+                    record.signature_offset = static_cast< std::uint32_t >( signatures.size() );
+                    record.signature_size = static_cast< std::uint32_t >( key.signature.size() );
+                    record.block = static_cast< std::uint32_t >( blocks.size() - 1 );
+                    record.stage = static_cast< std::uint8_t >( stage );
+                    cache_entries.push_back( record );
+
+                    signatures.insert( signatures.end(), key.signature.begin(), key.signature.end() );
+                }
+
+                // every entry the cache holds in memory
+                void add( const lift_cache_t &cache )
+                {
+                    cache.for_each( [ & ]( const block_key_t &key, cache_stage_t stage, const cached_block_t &cached )
+                                    { add( key, stage, cached ); } );
+                }
+
+                std::vector< std::uint8_t > serialize() const
+                {
+                    std::vector< std::uint8_t > out( sizeof( file_header_t ) );
+
+                    file_header_t header = {};
+                    header.magic = file_magic;
+                    header.version = file_version;
+                    header.lifters_version = LiftersVersion;
+
+                    header.routines = append( out, routines );
+                    header.blocks = append( out, blocks );
+                    header.successors = append( out, successors );
+                    header.instructions = append( out, instructions );
+                    header.operands = append( out, operands );
+                    header.registers = append( out, registers );
+                    header.names = append( out, names );
+                    header.strings = append( out, strings );
+                    header.cache_entries = append( out, cache_entries );
+                    header.signatures = append( out, signatures );
+
+                    std::memcpy( out.data(), &header, sizeof( header ) );
+                    return out;
+                }
+
+                bool write( const std::filesystem::path &path ) const
+                {
+                    const auto bytes = serialize();
+                    std::ofstream file( path, std::ios::binary );
+                    file.write( reinterpret_cast< const char * >( bytes.data() ), bytes.size() );
+                    return !!file;
+                }
+
+              private:
+                template < typename It >
+                block_record_t &add_block( It begin, It end, std::int64_t sp_offset, std::uint32_t sp_index,
+                                           std::uint64_t last_temporary_index, std::uint32_t routine )
+                {
+                    block_record_t block = {};
+                    block.sp_offset = sp_offset;
+                    block.sp_index = sp_index;
+                    block.last_temporary_index = last_temporary_index;
+                    block.first_instruction = static_cast< std::uint32_t >( instructions.size() );
+                    block.routine = routine;
+
+                    for ( auto it = begin; it != end; ++it )
+                        add_instruction( *it );
+
+                    block.instruction_count =
+                        static_cast< std::uint32_t >( instructions.size() ) - block.first_instruction;
+                    blocks.push_back( block );
+                    return blocks.back();
+                }
+
+                void add_instruction( const vtil::instruction &ins )
+                {
+                    instruction_record_t record = {};
+                    record.vip = ins.vip;
+                    record.sp_offset = ins.sp_offset;
+                    record.sp_index = ins.sp_index;
+                    record.sp_reset = ins.sp_reset;
+                    record.name = intern_name( ins.base->name );
+                    record.first_operand = static_cast< std::uint32_t >( operands.size() );
+                    record.operand_count = static_cast< std::uint8_t >( ins.operands.size() );
+
+                    for ( const auto &op : ins.operands )
+                    {
+                        operand_record_t operand = {};
+                        operand.bit_count = static_cast< std::uint16_t >( op.bit_count() );
+                        if ( op.is_immediate() )
+                        {
+                            operand.kind = operand_immediate;
+                            operand.imm = op.imm().u64;
+                        }
+                        else
+                        {
+                            operand.kind = operand_register;
+                            operand.reg = intern_register( op.reg() );
+                        }
+                        operands.push_back( operand );
+                    }
+
+                    instructions.push_back( record );
+                }
+
+                std::uint16_t intern_name( const std::string &name )
+                {
+                    const auto [ it, inserted ] = name_index.try_emplace( name, static_cast< std::uint16_t >( names.size() ) );
+                    if ( inserted )
+                    {
+                        names.push_back( { static_cast< std::uint32_t >( strings.size() ),
+                                           static_cast< std::uint32_t >( name.size() ) } );
+                        strings.insert( strings.end(), name.begin(), name.end() );
+                    }
+                    return it->second;
+                }
+
+                std::uint32_t intern_register( const vtil::register_desc &reg )
+                {
+                    const auto [ it, inserted ] =
+                        register_index.try_emplace( reg, static_cast< std::uint32_t >( registers.size() ) );
+                    if ( inserted )
+                    {
+                        register_record_t record = {};
+                        record.flags = reg.flags;
+                        record.local_id = reg.local_id;
+                        record.architecture = static_cast< std::uint8_t >( reg.architecture );
+                        record.bit_count = reg.bit_count;
+                        record.bit_offset = reg.bit_offset;
+                        registers.push_back( record );
+                    }
+                    return it->second;
+                }
+
+                template < typename T >
+                static section_t append( std::vector< std::uint8_t > &out, const std::vector< T > &records )
+                {
+                    out.resize( ( out.size() + 7 ) & ~std::size_t( 7 ) );
+
+                    const section_t section = { out.size(), records.size() };
+                    const auto bytes = records.size() * sizeof( T );
+                    out.resize( out.size() + bytes );
+                    if ( bytes )
+                        std::memcpy( out.data() + section.offset, records.data(), bytes );
+                    return section;
+                }
+
+                std::vector< routine_record_t > routines;
+                std::vector< block_record_t > blocks;
+                std::vector< std::uint64_t > successors;
+                std::vector< instruction_record_t > instructions;
+                std::vector< operand_record_t > operands;
+                std::vector< register_record_t > registers;
+                std::vector< name_record_t > names;
+                std::vector< char > strings;
+                std::vector< cache_entry_record_t > cache_entries;
+                std::vector< std::uint8_t > signatures;
+
+                std::unordered_map< std::string, std::uint16_t > name_index;
+                std::map< vtil::register_desc, std::uint32_t > register_index;
+            };
+
+            template < typename T > struct span_t
+            {
+                const T *data = nullptr;
+                std::size_t count = 0;
+
+                const T *begin() const
+                {
+                    return data;
+                }
+
+                const T *end() const
+                {
+                    return data + count;
+                }
+
+                std::size_t size() const
+                {
+                    return count;
+                }
+
+                const T &operator[]( std::size_t idx ) const
+                {
+                    return data[ idx ];
+                }
+            };
+
+            // reads a file in place. every section is bounds checked once in attach, after that the records are
+            // handed out as pointers into the mapping
+            class view_t
+            {
+              public:
+                bool open( const char *path )
+                {
+                    return file.open( path ) && attach( file.data(), file.size() );
+                }
+
+                // the buffer has to outlive the view
+                bool attach( const std::uint8_t *data, std::size_t size )
+                {
+                    base = nullptr;
+                    if ( size < sizeof( file_header_t ) || reinterpret_cast< std::uintptr_t >( data ) % 8 )
+                        return false;
+
+                    header = reinterpret_cast< const file_header_t * >( data );
+                    if ( header->magic != file_magic || header->version != file_version )
+                        return false;
+
+                    const auto fits = [ & ]( const section_t &section, std::size_t record_size )
+                    {
+                        return section.offset % 8 == 0 && section.offset <= size &&
+                               section.count <= ( size - section.offset ) / record_size;
+                    };
+
+                    if ( !fits( header->routines, sizeof( routine_record_t ) ) ||
+                         !fits( header->blocks, sizeof( block_record_t ) ) ||
+                         !fits( header->successors, sizeof( std::uint64_t ) ) ||
+                         !fits( header->instructions, sizeof( instruction_record_t ) ) ||
+                         !fits( header->operands, sizeof( operand_record_t ) ) ||
+                         !fits( header->registers, sizeof( register_record_t ) ) ||
+                         !fits( header->names, sizeof( name_record_t ) ) || !fits( header->strings, 1 ) ||
+                         !fits( header->cache_entries, sizeof( cache_entry_record_t ) ) ||
+                         !fits( header->signatures, 1 ) )
+                        return false;
+
+                    base = data;
+                    return validate();
+                }
+
+                bool is_valid() const
+                {
+                    return base != nullptr;
+                }
+
+                // true if the lifters that wrote the file emit what the current ones do
+                bool is_current() const
+                {
+                    return header->lifters_version == LiftersVersion;
+                }
+
+                span_t< routine_record_t > routines() const
+                {
+                    return section< routine_record_t >( header->routines );
+                }
+
+                span_t< block_record_t > blocks() const
+                {
+                    return section< block_record_t >( header->blocks );
+                }
+
+                span_t< block_record_t > blocks( const routine_record_t &routine ) const
+                {
+                    return { blocks().data + routine.first_block, routine.block_count };
+                }
+
+                span_t< std::uint64_t > successors( const block_record_t &block ) const
+                {
+                    return { section< std::uint64_t >( header->successors ).data + block.first_successor,
+                             block.successor_count };
+                }
+
+                span_t< instruction_record_t > instructions( const block_record_t &block ) const
+                {
+                    return { section< instruction_record_t >( header->instructions ).data + block.first_instruction,
+                             block.instruction_count };
+                }
+
+                span_t< operand_record_t > operands( const instruction_record_t &ins ) const
+                {
+                    return { section< operand_record_t >( header->operands ).data + ins.first_operand,
+                             ins.operand_count };
+                }
+
+                const register_record_t &reg( const operand_record_t &op ) const
+                {
+                    return section< register_record_t >( header->registers )[ op.reg ];
+                }
+
+                std::string_view name( const instruction_record_t &ins ) const
+                {
+                    const auto &record = section< name_record_t >( header->names )[ ins.name ];
+                    return { reinterpret_cast< const char * >( base + header->strings.offset ) + record.offset,
+                             record.size };
+                }
+
+                span_t< cache_entry_record_t > cache_entries() const
+                {
+                    return section< cache_entry_record_t >( header->cache_entries );
+                }
+
+                // rebuilds a vtil routine, nullptr if an instruction is not part of vtil's instruction set
+                vtil::routine *load( const routine_record_t &routine ) const
+                {
+                    const auto blks = blocks( routine );
+                    if ( !blks.size() )
+                        return nullptr;
+
+                    std::unique_ptr< vtil::routine > rtn( vtil::basic_block::begin( routine.entry_vip )->owner );
+
+                    for ( const auto &block : blks )
+                    {
+                        cached_block_t cached;
+                        if ( !load( block, cached ) )
+                            return nullptr;
+
+                        auto [ blk, inserted ] = rtn->create_block( block.vip );
+                        cached.restore( blk );
+                    }
+
+                    // link the blocks once all of them exist
+                    for ( const auto &block : blks )
+                    {
+                        auto blk = rtn->explored_blocks[ block.vip ];
+                        for ( const auto successor : successors( block ) )
+                        {
+                            const auto found = rtn->explored_blocks.find( successor );
+                            if ( found == rtn->explored_blocks.end() )
+                                continue;
+
+                            blk->next.push_back( found->second );
+                            found->second->prev.push_back( blk );
+                        }
+                    }
+
+                    return rtn.release();
+                }
+
+                // the cache entry for key in this file, nullptr if there is none
+                std::shared_ptr< const cached_block_t > find( const block_key_t &key, cache_stage_t stage ) const
+                {
+                    const auto signatures = base + header->signatures.offset;
+                    const auto range = cache_index.equal_range( key.hash );
+                    for ( auto it = range.first; it != range.second; ++it )
+                    {
+                        const auto &entry = cache_entries()[ it->second ];
+                        if ( entry.stage != static_cast< std::uint8_t >( stage ) ||
+                             entry.signature_size != key.signature.size() ||
+                             std::memcmp( signatures + entry.signature_offset, key.signature.data(),
+                                          entry.signature_size ) )
+                            continue;
+
+                        auto cached = std::make_shared< cached_block_t >();
+                        if ( !load( blocks()[ entry.block ], *cached ) )
+                            return nullptr;
+                        return cached;
+                    }
+
+                    return nullptr;
+                }
+
+                bool load( const block_record_t &block, cached_block_t &cached ) const
+                {
+                    cached.sp_offset = block.sp_offset;
+                    cached.sp_index = block.sp_index;
+                    cached.last_temporary_index = block.last_temporary_index;
+                    cached.instructions.clear();
+                    cached.instructions.reserve( block.instruction_count );
+
+                    for ( const auto &record : instructions( block ) )
+                    {
+                        const auto desc = find_instruction( name( record ) );
+                        if ( !desc )
+                            return false;
+
+                        std::vector< vtil::operand > ops;
+                        ops.reserve( record.operand_count );
+                        for ( const auto &op : operands( record ) )
+                        {
+                            if ( op.kind == operand_immediate )
+                                ops.emplace_back( op.imm, static_cast< vtil::bitcnt_t >( op.bit_count ) );
+                            else
+                            {
+                                const auto &reg = this->reg( op );
+                                ops.emplace_back( vtil::register_desc( reg.flags, reg.local_id, reg.bit_count,
+                                                                       reg.bit_offset, reg.architecture ) );
+                            }
+                        }
+
+                        vtil::instruction ins( desc, std::move( ops ) );
+                        ins.vip = record.vip;
+                        ins.sp_offset = record.sp_offset;
+                        ins.sp_index = record.sp_index;
+                        ins.sp_reset = record.sp_reset;
+                        cached.instructions.push_back( std::move( ins ) );
+                    }
+
+                    return true;
+                }
+
+              private:
+                template < typename T > span_t< T > section( const section_t &section ) const
+                {
+                    return { reinterpret_cast< const T * >( base + section.offset ),
+                             static_cast< std::size_t >( section.count ) };
+                }
+
+                // every index in the file stays inside the section it points into
+                bool validate()
+                {
+                    const auto valid = [ & ]
+                    {
+                        for ( const auto &routine : routines() )
+                            if ( std::uint64_t( routine.first_block ) + routine.block_count > header->blocks.count )
+                                return false;
+
+                        for ( const auto &block : blocks() )
+                        {
+                            if ( std::uint64_t( block.first_instruction ) + block.instruction_count >
+                                     header->instructions.count ||
+                                 std::uint64_t( block.first_successor ) + block.successor_count >
+                                     header->successors.count )
+                                return false;
+                        }
+
+                        for ( const auto &ins : section< instruction_record_t >( header->instructions ) )
+                        {
+                            if ( std::uint64_t( ins.first_operand ) + ins.operand_count > header->operands.count ||
+                                 ins.name >= header->names.count )
+                                return false;
+                        }
+
+                        for ( const auto &op : section< operand_record_t >( header->operands ) )
+                            if ( op.kind == operand_register && op.reg >= header->registers.count )
+                                return false;
+
+                        for ( const auto &name : section< name_record_t >( header->names ) )
+                            if ( std::uint64_t( name.offset ) + name.size > header->strings.count )
+                                return false;
+
+                        for ( const auto &entry : cache_entries() )
+                        {
+                            if ( entry.block >= header->blocks.count ||
+                                 std::uint64_t( entry.signature_offset ) + entry.signature_size >
+                                     header->signatures.count )
+                                return false;
+                        }
+
+                        return true;
+                    }();
+
+                    if ( !valid )
+                    {
+                        base = nullptr;
+                        return false;
+                    }
+
+                    cache_index.clear();
+                    const auto entries = cache_entries();
+                    for ( std::uint32_t idx = 0; idx < entries.size(); ++idx )
+                        cache_index.emplace( entries[ idx ].hash, idx );
+
+                    return true;
+                }
+
+                static const vtil::instruction_desc *find_instruction( std::string_view name )
+                {
+                    static const auto descs = []
+                    {
+                        std::unordered_map< std::string_view, const vtil::instruction_desc * > descs;
+                        for ( const auto &desc : vtil::ins::list )
+                            descs.emplace( desc.name, &desc );
+                        return descs;
+                    }();
+
+                    const auto found = descs.find( name );
+                    return found != descs.end() ? found->second : nullptr;
+                }
+
+                mapped_file_t file;
+                const file_header_t *header = nullptr;
+                const std::uint8_t *base = nullptr;
+
+                // hash of every cache entry -> its index
+                std::unordered_multimap< std::uint64_t, std::uint32_t > cache_index;
+            };
+        } // namespace compact
+    } // namespace lifter_vtil
+} // namespace lifters
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "lift_cache.hpp"
+
+namespace lifters
+{
+    namespace lifter_vtil
+    {
+        // what a lifted block depends on. a block is lifted again when any of it changes
+        struct block_manifest_t
+        {
+            // make_block_key of the block: its virtual instructions, the options, the versions of the lifters it
+            // uses and the vm context it coalesces, which carries the liveness of the blocks after it
+            std::uint64_t fingerprint = 0;
+
+            // bit n set if the block uses a handler of family_t n
+            std::uint64_t families = 0;
+
+            // lifter_versions( families ) when the block was lifted
+            std::uint64_t versions = 0;
+
+            // the blocks it branches to
+            std::vector< std::uintptr_t > successors;
+
+            bool operator==( const block_manifest_t &other ) const
+            {
+                return fingerprint == other.fingerprint && families == other.families && versions == other.versions &&
+                       successors == other.successors;
+            }
+        };
+
+        struct relift_stats_t
+        {
+            std::size_t blocks = 0;
+            std::size_t reused = 0;
+            std::size_t relifted = 0;
+            std::size_t failed = 0;
+
+            // vip of every block that was lifted again
+            std::vector< std::uintptr_t > invalidated;
+        };
+
+        // lifts the code block into a routine of its own and optimizes it there, nullptr if one of its instructions
+        // has no lifter. ctx->blk is set to the entry of that routine
+        inline std::unique_ptr< vtil::routine > lift_isolated( lift_context_t *ctx, vmp2::v3::code_block_t *code_blk )
+        {
+            std::unique_ptr< vtil::routine > scratch( vtil::basic_block::begin( code_blk->vip_begin )->owner );
+            ctx->blk = scratch->entry_point;
+
+            if ( !lift( ctx, code_blk ) )
+                return nullptr;
+
+            vtil::optimizer::apply_all( scratch.get() );
+            return scratch;
+        }
+
+        // the full lift incremental_lifter_t::lift reproduces: every code block lifted and optimized on its own, then
+        // copied into rtn. blocks that fail to lift are left empty. rtn must not contain blocks for them yet
+        inline bool lift_isolated( vtil::routine *rtn, const std::vector< vmp2::v3::code_block_t * > &code_blks,
+                                   lift_options_t options = {} )
+        {
+            context_liveness_t liveness;
+            if ( options.coalesce_context )
+                liveness.analyze( code_blks );
+
+            bool lifted = true;
+            for ( const auto code_blk : code_blks )
+            {
+                auto blk = rtn->create_block( code_blk->vip_begin ).first;
+
+                lift_context_t ctx( nullptr, options );
+                ctx.context_liveness = &liveness;
+
+                if ( const auto scratch = lift_isolated( &ctx, code_blk ) )
+                    cached_block_t::capture( scratch->entry_point ).restore( blk );
+                else
+                    lifted = false;
+            }
+
+            return lifted;
+        }
+
+        // lifts routines again after a lifter changed or new branch targets were found, only redoing the blocks that
+        // were invalidated. every block is lifted and optimized on its own, the result goes into the optimized stage
+        // of the cache, and the manifest records what it depended on. on the next run a block whose manifest is
+        // unchanged is restored from the cache instead.
+        //
+        // the optimizer never sees more than one block, so nothing is propagated or folded across block boundaries.
+        // that is what keeps a cached block valid while its neighbours change. the output is the same as
+        // lift_isolated, see oracle::check_incremental. run vtil::optimizer::apply_all over the routine afterwards
+        // for a whole routine result, it is not cached.
+        //
+        // with coalesce_context the lifted output of a block depends on what is live after it. the coalesced
+        // granules are part of the fingerprint, so a predecessor of a block whose successors or vm context
+        // accesses changed is invalidated exactly when what it coalesces changes.
+        //
+        // blocks are identified by vip, keep one manifest per binary
+        class incremental_lifter_t
+        {
+          public:
+            static constexpr std::uint32_t file_magic = 0x4d544c56; // "VLTM"
+            static constexpr std::uint32_t file_version = 1;
+
+            incremental_lifter_t( lift_cache_t &cache, lift_options_t options = {} ) : cache( cache ), options( options )
+            {
+            }
+
+            // lifts every code block into rtn, which must not contain blocks for them yet
+            relift_stats_t lift( vtil::routine *rtn, const std::vector< vmp2::v3::code_block_t * > &code_blks )
+            {
+                relift_stats_t stats;
+
+                context_liveness_t liveness;
+                if ( options.coalesce_context )
+                    liveness.analyze( code_blks );
+
+                arena_t arena;
+
+                for ( const auto code_blk : code_blks )
+                {
+                    ++stats.blocks;
+
+                    // a context per block, it keeps its state in the arena and has to be gone before it is reset
+                    std::optional< lift_context_t > ctx( std::in_place, nullptr, options, &arena );
+                    ctx->context_liveness = &liveness;
+
+                    const auto key = make_block_key( code_blk, options, ctx->coalesced_granules( code_blk ) );
+                    const auto manifest = make_manifest( code_blk, key );
+                    auto [ blk, inserted ] = rtn->create_block( code_blk->vip_begin );
+
+                    const auto previous = manifests.find( code_blk->vip_begin );
+                    if ( previous != manifests.end() && previous->second == manifest )
+                    {
+                        if ( const auto cached = cache.find( key, cache_stage_t::optimized ) )
+                        {
+                            cached->restore( blk );
+                            ++stats.reused;
+                            continue;
+                        }
+                    }
+
+                    stats.invalidated.push_back( code_blk->vip_begin );
+
+                    // lift and optimize the block on its own so the result does not depend on the rest of the routine
+                    const auto scratch = lift_isolated( &*ctx, code_blk );
+                    ctx.reset();
+                    arena.reset();
+
+                    if ( !scratch )
+                    {
+                        ++stats.failed;
+                        manifests.erase( code_blk->vip_begin );
+                        continue;
+                    }
+
+                    cache.store( key, cache_stage_t::optimized, scratch->entry_point );
+
+                    cached_block_t::capture( scratch->entry_point ).restore( blk );
+
+                    manifests[ code_blk->vip_begin ] = manifest;
+                    ++stats.relifted;
+                }
+
+                return stats;
+            }
+
+            // drops the manifest of a block, it is lifted again on the next run
+            void invalidate( std::uintptr_t vip )
+            {
+                manifests.erase( vip );
+            }
+
+            // drops the manifest of every block using a handler of the family
+            void invalidate( family_t family )
+            {
+                for ( auto it = manifests.begin(); it != manifests.end(); )
+                {
+                    if ( it->second.families & ( 1ull << static_cast< unsigned >( family ) ) )
+                        it = manifests.erase( it );
+                    else
+                        ++it;
+                }
+            }
+
+            // the blocks that branch to vip
+            std::vector< std::uintptr_t > predecessors( std::uintptr_t vip ) const
+            {
+                std::vector< std::uintptr_t > result;
+                for ( const auto &[ block, manifest ] : manifests )
+                    if ( std::find( manifest.successors.begin(), manifest.successors.end(), vip ) !=
+                         manifest.successors.end() )
+                        result.push_back( block );
+                return result;
+            }
+
+            // file layout: magic, file version, block count, then for every block its vip, fingerprint, families,
+            // versions, successor count and successors
+            bool save( const std::filesystem::path &path ) const
+            {
+                std::ofstream file( path, std::ios::binary );
+                if ( !file )
+                    return false;
+
+                write( file, file_magic );
+                write( file, file_version );
+                write( file, static_cast< std::uint64_t >( manifests.size() ) );
+
+                for ( const auto &[ vip, manifest ] : manifests )
+                {
+                    write( file, static_cast< std::uint64_t >( vip ) );
+                    write( file, manifest.fingerprint );
+                    write( file, manifest.families );
+                    write( file, manifest.versions );
+                    write( file, static_cast< std::uint32_t >( manifest.successors.size() ) );
+                    for ( const auto successor : manifest.successors )
+                        write( file, static_cast< std::uint64_t >( successor ) );
+                }
+
+                return !!file;
+            }
+
+            // a missing or outdated manifest is not an error, every block is lifted again
+            bool load( const std::filesystem::path &path )
+            {
+                manifests.clear();
+
+                std::ifstream file( path, std::ios::binary );
+                std::uint32_t magic, version;
+                std::uint64_t count;
+                if ( !file || !read( file, magic ) || !read( file, version ) || !read( file, count ) ||
+                     magic != file_magic || version != file_version )
+                    return false;
+
+                for ( std::uint64_t idx = 0; idx < count; ++idx )
+                {
+                    std::uint64_t vip;
+                    std::uint32_t successor_count;
+                    block_manifest_t manifest;
+                    if ( !read( file, vip ) || !read( file, manifest.fingerprint ) || !read( file, manifest.families ) ||
+                         !read( file, manifest.versions ) || !read( file, successor_count ) || successor_count > 2 )
+                    {
+                        manifests.clear();
+                        return false;
+                    }
+
+                    for ( auto successor = 0u; successor < successor_count; ++successor )
+                    {
+                        std::uint64_t target;
+                        if ( !read( file, target ) )
+                        {
+                            manifests.clear();
+                            return false;
+                        }
+                        manifest.successors.push_back( static_cast< std::uintptr_t >( target ) );
+                    }
+
+                    manifests.emplace( static_cast< std::uintptr_t >( vip ), std::move( manifest ) );
+                }
+
+                return true;
+            }
+
+          private:
+            static block_manifest_t make_manifest( const vmp2::v3::code_block_t *code_blk, const block_key_t &key )
+            {
+                block_manifest_t manifest;
+                manifest.fingerprint = key.hash;
+                manifest.families = used_families( code_blk );
+                manifest.versions = lifter_versions( manifest.families );
+
+                const auto &jcc = code_blk->jcc;
+                if ( jcc.has_jcc )
+                {
+                    manifest.successors.push_back( jcc.block_addr[ 0 ] );
+                    if ( jcc.type == vm::instrs::jcc_type::branching )
+                        manifest.successors.push_back( jcc.block_addr[ 1 ] );
+                }
+
+                return manifest;
+            }
+
+            template < typename T >
+            static void write( std::ostream &out, const T &value )
+            {
+                out.write( reinterpret_cast< const char * >( &value ), sizeof( value ) );
+            }
+
+            template < typename T >
+            static bool read( std::istream &in, T &value )
+            {
+                return !!in.read( reinterpret_cast< char * >( &value ), sizeof( value ) );
+            }
+
+            lift_cache_t &cache;
+            lift_options_t options;
+            std::unordered_map< std::uintptr_t, block_manifest_t > manifests;
+        };
+    } // namespace lifter_vtil
+} // namespace lifters
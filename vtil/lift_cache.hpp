@@ -0,0 +1,364 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/fingerprint.hpp"
+#include "vtil.hpp"
+
+namespace lifters
+{
+    namespace lifter_vtil
+    {
+        enum class cache_stage_t : std::uint8_t
+        {
+            lifted,
+            optimized,
+        };
+
+        // identifies a code block by its contents: the mnemonics and immediates of its virtual instructions,
+        // the lift options and the versions of the lifters it uses. the vip of the block is not part of it, so
+        // duplicate blocks anywhere in a binary (or in other builds of it) share an entry
+        struct block_key_t
+        {
+            std::uint64_t hash = 0;
+            std::vector< std::uint8_t > signature;
+
+            bool operator==( const block_key_t &other ) const
+            {
+                return hash == other.hash && signature == other.signature;
+            }
+        };
+
+        // coalesced is lift_context_t::coalesced_granules of the block, it depends on the rest of the routine.
+        // the signature is the packed words of the header and of every virtual instruction, see fingerprint::pack
+        inline block_key_t make_block_key( const vmp2::v3::code_block_t *code_blk, lift_options_t options,
+                                           std::uint32_t coalesced = 0 )
+        {
+            const auto versions = lifter_versions( used_families( code_blk ) );
+            std::vector< std::uint32_t > words = { LiftersVersion, static_cast< std::uint32_t >( versions ),
+                                                   static_cast< std::uint32_t >( versions >> 32 ), options.key(),
+                                                   coalesced };
+            fingerprint::pack( code_blk, words );
+
+            block_key_t key;
+            key.hash = fingerprint::hash( words.data(), words.size() );
+            key.signature.resize( words.size() * sizeof( std::uint32_t ) );
+            std::memcpy( key.signature.data(), words.data(), key.signature.size() );
+            return key;
+        }
+
+        // the lifted instructions of a block and the stack state it ends with
+        struct cached_block_t
+        {
+            std::vector< vtil::instruction > instructions;
+            std::int64_t sp_offset = 0;
+            std::uint32_t sp_index = 0;
+            std::uint64_t last_temporary_index = 0;
+
+            static cached_block_t capture( const vtil::basic_block *blk )
+            {
+                cached_block_t cached;
+                for ( const auto &ins : *blk )
+                    cached.instructions.push_back( ins );
+
+                cached.sp_offset = blk->sp_offset;
+                cached.sp_index = blk->sp_index;
+                cached.last_temporary_index = blk->last_temporary_index;
+                return cached;
+            }
+
+            // replays the instructions into an empty block. the stack pointer is shifted to where it was before every
+            // instruction so the offsets vtil tracks for the block come out the same as when it was lifted
+            void restore( vtil::basic_block *blk ) const
+            {
+                for ( const auto &ins : instructions )
+                {
+                    if ( blk->sp_offset != ins.sp_offset )
+                        blk->shift_sp( ins.sp_offset - blk->sp_offset );
+
+                    blk->push_back( vtil::instruction{ ins } );
+                }
+
+                if ( blk->sp_offset != sp_offset )
+                    blk->shift_sp( sp_offset - blk->sp_offset );
+
+                blk->sp_index = sp_index;
+                blk->last_temporary_index = last_temporary_index;
+            }
+        };
+
+        // in memory cache of lifted blocks, optionally backed by a directory that persists between runs.
+        // optimized entries hold whatever the caller stored after optimizing the block on its own.
+        // safe to share between the threads of lift_parallel
+        class lift_cache_t
+        {
+          public:
+            static constexpr std::uint32_t file_magic = 0x56544c43; // "CLTV"
+            static constexpr std::uint32_t file_version = 3;
+
+            // keys sharing a hash are stored in consecutive slots, see path_of
+            static constexpr unsigned max_slots = 16;
+
+            explicit lift_cache_t( std::filesystem::path directory = {} ) : directory( std::move( directory ) )
+            {
+                if ( !this->directory.empty() )
+                    std::filesystem::create_directories( this->directory );
+            }
+
+            std::shared_ptr< const cached_block_t > find( const block_key_t &key, cache_stage_t stage )
+            {
+                {
+                    std::lock_guard lock( mutex );
+                    const auto &bucket = entries[ static_cast< std::size_t >( stage ) ];
+                    const auto range = bucket.equal_range( key.hash );
+                    for ( auto it = range.first; it != range.second; ++it )
+                    {
+                        if ( it->second.signature == key.signature )
+                        {
+                            ++hits;
+                            return it->second.block;
+                        }
+                    }
+                }
+
+                auto block = load( key, stage );
+
+                std::lock_guard lock( mutex );
+                if ( !block )
+                {
+                    ++misses;
+                    return nullptr;
+                }
+
+                ++hits;
+                insert( key, stage, block );
+                return block;
+            }
+
+            void store( const block_key_t &key, cache_stage_t stage, const vtil::basic_block *blk )
+            {
+                auto block = std::make_shared< const cached_block_t >( cached_block_t::capture( blk ) );
+                save( key, stage, *block );
+
+                std::lock_guard lock( mutex );
+                insert( key, stage, std::move( block ) );
+            }
+
+            // calls fn( key, stage, block ) for every entry held in memory
+            template < typename F > void for_each( F &&fn ) const
+            {
+                std::lock_guard lock( mutex );
+                for ( auto stage = 0u; stage < 2; ++stage )
+                {
+                    for ( const auto &[ hash, entry ] : entries[ stage ] )
+                        fn( block_key_t{ hash, entry.signature }, static_cast< cache_stage_t >( stage ), *entry.block );
+                }
+            }
+
+            std::size_t hit_count() const
+            {
+                std::lock_guard lock( mutex );
+                return hits;
+            }
+
+            std::size_t miss_count() const
+            {
+                std::lock_guard lock( mutex );
+                return misses;
+            }
+
+          private:
+            struct entry_t
+            {
+                std::vector< std::uint8_t > signature;
+                std::shared_ptr< const cached_block_t > block;
+            };
+
+            // replaces the entry of the same key if there is one, call with the mutex held
+            void insert( const block_key_t &key, cache_stage_t stage, std::shared_ptr< const cached_block_t > block )
+            {
+                auto &bucket = entries[ static_cast< std::size_t >( stage ) ];
+                const auto range = bucket.equal_range( key.hash );
+                for ( auto it = range.first; it != range.second; ++it )
+                {
+                    if ( it->second.signature == key.signature )
+                    {
+                        it->second.block = std::move( block );
+                        return;
+                    }
+                }
+
+                bucket.insert( { key.hash, { key.signature, std::move( block ) } } );
+            }
+
+            // <hash>.<stage>.<slot>.vlc, keys whose hashes collide get a slot each. the file of a slot is only
+            // used for the key whose signature it holds
+            std::filesystem::path path_of( const block_key_t &key, cache_stage_t stage, unsigned slot ) const
+            {
+                char name[ 48 ];
+                std::snprintf( name, sizeof( name ), "%016llx.%u.%u.vlc", static_cast< unsigned long long >( key.hash ),
+                               static_cast< unsigned >( stage ), slot );
+                return directory / name;
+            }
+
+            template < typename T >
+            static void write( std::ostream &out, const T &value )
+            {
+                out.write( reinterpret_cast< const char * >( &value ), sizeof( value ) );
+            }
+
+            template < typename T >
+            static bool read( std::istream &in, T &value )
+            {
+                return !!in.read( reinterpret_cast< char * >( &value ), sizeof( value ) );
+            }
+
+            enum class header_t : std::uint8_t
+            {
+                invalid,
+                other_key,
+                same_key,
+            };
+
+            // reads the magic, the version and the signature an entry starts with and compares the signature to key
+            static header_t read_header( std::istream &in, const block_key_t &key )
+            {
+                std::uint32_t magic, version, signature_size;
+                if ( !read( in, magic ) || !read( in, version ) || !read( in, signature_size ) ||
+                     magic != file_magic || version != file_version )
+                    return header_t::invalid;
+
+                if ( signature_size != key.signature.size() )
+                    return header_t::other_key;
+
+                std::vector< std::uint8_t > signature( signature_size );
+                if ( !in.read( reinterpret_cast< char * >( signature.data() ), signature_size ) )
+                    return header_t::invalid;
+
+                return signature == key.signature ? header_t::same_key : header_t::other_key;
+            }
+
+            // the first slot that is free, holds the same key or holds no valid entry. max_slots if they are all
+            // taken by other keys. two threads storing colliding keys at once can pick the same slot, the entry of
+            // one of them is lost and lifted again the next time, load never returns the other key's entry
+            unsigned free_slot( const block_key_t &key, cache_stage_t stage ) const
+            {
+                for ( auto slot = 0u; slot < max_slots; ++slot )
+                {
+                    std::ifstream file( path_of( key, stage, slot ), std::ios::binary );
+                    if ( !file || read_header( file, key ) != header_t::other_key )
+                        return slot;
+                }
+                return max_slots;
+            }
+
+            // file layout: magic, file version, signature size, signature, sp offset, sp index, last temporary
+            // index, instruction count, instructions in vtil's serialization format. the lifter version and options
+            // are the first bytes of the signature
+            void save( const block_key_t &key, cache_stage_t stage, const cached_block_t &block ) const
+            {
+                if ( directory.empty() )
+                    return;
+
+                const auto slot = free_slot( key, stage );
+                if ( slot == max_slots )
+                    return;
+
+                std::stringstream out;
+                write( out, file_magic );
+                write( out, file_version );
+                write( out, static_cast< std::uint32_t >( key.signature.size() ) );
+                out.write( reinterpret_cast< const char * >( key.signature.data() ), key.signature.size() );
+                write( out, block.sp_offset );
+                write( out, block.sp_index );
+                write( out, block.last_temporary_index );
+                write( out, static_cast< std::uint32_t >( block.instructions.size() ) );
+
+                for ( const auto &ins : block.instructions )
+                    vtil::serialize( out, ins );
+
+                // write to a temporary file first so a concurrent reader never sees half an entry
+                const auto path = path_of( key, stage, slot );
+                auto temporary = path;
+                temporary += "." + std::to_string( std::hash< std::thread::id >{}( std::this_thread::get_id() ) );
+
+                {
+                    std::ofstream file( temporary, std::ios::binary );
+                    file << out.rdbuf();
+                }
+
+                std::error_code ec;
+                std::filesystem::rename( temporary, path, ec );
+                if ( ec )
+                    std::filesystem::remove( temporary, ec );
+            }
+
+            std::shared_ptr< const cached_block_t > load( const block_key_t &key, cache_stage_t stage ) const
+            {
+                if ( directory.empty() )
+                    return nullptr;
+
+                for ( auto slot = 0u; slot < max_slots; ++slot )
+                {
+                    std::ifstream file( path_of( key, stage, slot ), std::ios::binary );
+                    if ( !file )
+                        return nullptr;
+
+                    if ( read_header( file, key ) == header_t::same_key )
+                        return load_block( file );
+                }
+                return nullptr;
+            }
+
+            // reads the rest of an entry after its header
+            static std::shared_ptr< const cached_block_t > load_block( std::istream &file )
+            {
+                auto block = std::make_shared< cached_block_t >();
+                std::uint32_t count;
+                if ( !read( file, block->sp_offset ) || !read( file, block->sp_index ) ||
+                     !read( file, block->last_temporary_index ) || !read( file, count ) )
+                    return nullptr;
+
+                block->instructions.resize( count );
+                for ( auto &ins : block->instructions )
+                    vtil::deserialize( file, ins );
+
+                return file ? block : nullptr;
+            }
+
+            std::filesystem::path directory;
+
+            mutable std::mutex mutex;
+            std::unordered_multimap< std::uint64_t, entry_t > entries[ 2 ];
+            std::size_t hits = 0, misses = 0;
+        };
+
+        // lifts the code block through the cache, blk has to be empty
+        inline bool lift( lift_cache_t &cache, lift_context_t *ctx, vmp2::v3::code_block_t *code_blk )
+        {
+            const auto key = make_block_key( code_blk, ctx->options, ctx->coalesced_granules( code_blk ) );
+            if ( const auto cached = cache.find( key, cache_stage_t::lifted ) )
+            {
+                cached->restore( ctx->blk );
+                return true;
+            }
+
+            if ( !lift( ctx, code_blk ) )
+                return false;
+
+            cache.store( key, cache_stage_t::lifted, ctx->blk );
+            return true;
+        }
+    } // namespace lifter_vtil
+} // namespace lifters
@@ -0,0 +1,591 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/interpreter.hpp"
+#include "../common/synthetic.hpp"
+#include "incremental.hpp"
+#include "vtil.hpp"
+
+namespace lifters
+{
+    namespace lifter_vtil
+    {
+        // runs lifted blocks on the interpreter's machine model and compares them with the interpreter running the
+        // virtual instructions themselves. any difference is a lifter bug, or a gap in what the interpreter models
+        namespace oracle
+        {
+            using interpreter::machine_t;
+            using interpreter::status_t;
+
+            enum class vop_t : std::uint8_t
+            {
+                mov,
+                movsx,
+                add,
+                sub,
+                mul,
+                mulhi,
+                div,
+                rem,
+                band,
+                bor,
+                bxor,
+                bnot,
+                neg,
+                bshr,
+                bshl,
+                ldd,
+                str,
+                te,
+                tne,
+                tl,
+                tle,
+                tul,
+                tule,
+                nop,
+            };
+
+            // a lifted block with the opcode of every instruction resolved once, so evaluating it many times never
+            // compares instruction names
+            struct compiled_block_t
+            {
+                std::vector< const vtil::instruction * > instructions;
+                std::vector< vop_t > ops;
+                std::int64_t sp_offset = 0;
+            };
+
+            // false if the block uses an instruction the evaluator does not know, like the vemits of rdtsc
+            inline bool compile( const vtil::basic_block *blk, compiled_block_t &compiled )
+            {
+                static const std::unordered_map< std::string_view, vop_t > names = {
+                    { "mov", vop_t::mov },     { "movsx", vop_t::movsx }, { "add", vop_t::add },   { "sub", vop_t::sub },
+                    { "mul", vop_t::mul },     { "mulhi", vop_t::mulhi }, { "div", vop_t::div },   { "rem", vop_t::rem },
+                    { "and", vop_t::band },    { "or", vop_t::bor },      { "xor", vop_t::bxor },  { "not", vop_t::bnot },
+                    { "neg", vop_t::neg },     { "shr", vop_t::bshr },    { "shl", vop_t::bshl },  { "ldd", vop_t::ldd },
+                    { "str", vop_t::str },     { "te", vop_t::te },       { "tne", vop_t::tne },   { "tl", vop_t::tl },
+                    { "tle", vop_t::tle },     { "tul", vop_t::tul },     { "tule", vop_t::tule }, { "nop", vop_t::nop },
+                };
+
+                compiled.instructions.clear();
+                compiled.ops.clear();
+
+                for ( const auto &ins : *blk )
+                {
+                    const auto found = names.find( ins.base->name );
+                    if ( found == names.end() )
+                        return false;
+
+                    compiled.instructions.push_back( &ins );
+                    compiled.ops.push_back( found->second );
+                }
+
+                compiled.sp_offset = blk->sp_offset;
+                return true;
+            }
+
+            // concrete evaluator for the instructions the lifters emit. temporaries live in a map, virtual registers
+            // in the vm context, $sp is the virtual stack pointer and $flags rflags. undefined reads as zero, the
+            // lifters only push it for flags nothing reads
+            class evaluator_t
+            {
+              public:
+                explicit evaluator_t( machine_t &machine ) : machine( machine ), sp( machine.vsp )
+                {
+                }
+
+                status_t run( const compiled_block_t &compiled )
+                {
+                    for ( std::size_t idx = 0; idx < compiled.ops.size(); ++idx )
+                    {
+                        if ( !execute( compiled.ops[ idx ], *compiled.instructions[ idx ] ) )
+                            return faulted ? status_t::fault : status_t::unsupported;
+                    }
+
+                    machine.vsp = sp + compiled.sp_offset;
+                    return status_t::ok;
+                }
+
+              private:
+                static std::uint64_t mask( vtil::bitcnt_t bits )
+                {
+                    return machine_t::mask( static_cast< unsigned >( bits ) );
+                }
+
+                static std::int64_t sign_extend( std::uint64_t value, vtil::bitcnt_t bits )
+                {
+                    if ( bits >= 64 || !( value >> ( bits - 1 ) & 1 ) )
+                        return static_cast< std::int64_t >( value );
+                    return static_cast< std::int64_t >( value | ~mask( bits ) );
+                }
+
+                // the whole 64 bits of the register behind the operand
+                bool read_full( const vtil::register_desc &reg, const vtil::instruction &ins, std::uint64_t &value )
+                {
+                    if ( reg.is_stack_pointer() )
+                        value = sp + ins.sp_offset;
+                    else if ( reg.is_flags() )
+                        value = machine.rflags;
+                    else if ( reg.is_local() )
+                        value = temporaries[ reg.local_id ];
+                    else if ( reg.is_virtual() )
+                        value = machine.read_context( reg.local_id * 8, 8 );
+                    else if ( reg.is_undefined() )
+                        value = 0;
+                    else
+                        return false;
+
+                    return true;
+                }
+
+                bool read( const vtil::operand &op, const vtil::instruction &ins, std::uint64_t &value )
+                {
+                    if ( op.is_immediate() )
+                    {
+                        value = op.imm().u64 & mask( op.bit_count() );
+                        return true;
+                    }
+
+                    const auto &reg = op.reg();
+                    if ( !read_full( reg, ins, value ) )
+                        return false;
+
+                    value = ( reg.bit_offset >= 64 ? 0 : value >> reg.bit_offset ) & mask( reg.bit_count );
+                    return true;
+                }
+
+                bool write( const vtil::operand &op, const vtil::instruction &ins, std::uint64_t value )
+                {
+                    const auto &reg = op.reg();
+                    std::uint64_t full;
+                    if ( !read_full( reg, ins, full ) )
+                        return false;
+
+                    const auto field = mask( reg.bit_count ) << reg.bit_offset;
+                    full = ( full & ~field ) | ( ( value << reg.bit_offset ) & field );
+
+                    // writing $sp moves the base later instructions are relative to
+                    if ( reg.is_undefined() )
+                        return true;
+                    if ( reg.is_stack_pointer() )
+                        sp = full;
+                    else if ( reg.is_flags() )
+                        machine.rflags = full;
+                    else if ( reg.is_local() )
+                        temporaries[ reg.local_id ] = full;
+                    else
+                        machine.write_context( reg.local_id * 8, full, 8 );
+
+                    return true;
+                }
+
+                bool execute( vop_t op, const vtil::instruction &ins )
+                {
+                    const auto &operands = ins.operands;
+                    std::uint64_t a = 0, b = 0, c = 0;
+
+                    switch ( op )
+                    {
+                    case vop_t::nop:
+                        return true;
+
+                    case vop_t::mov:
+                        return read( operands[ 1 ], ins, a ) && write( operands[ 0 ], ins, a );
+
+                    case vop_t::movsx:
+                        return read( operands[ 1 ], ins, a ) &&
+                               write( operands[ 0 ], ins, sign_extend( a, operands[ 1 ].bit_count() ) );
+
+                    case vop_t::bnot:
+                    case vop_t::neg:
+                        if ( !read( operands[ 0 ], ins, a ) )
+                            return false;
+                        return write( operands[ 0 ], ins, op == vop_t::bnot ? ~a : 0 - a );
+
+                    case vop_t::ldd:
+                        if ( !read( operands[ 1 ], ins, a ) || !read( operands[ 2 ], ins, b ) )
+                            return false;
+                        return write( operands[ 0 ], ins, machine.memory.read( a + b, operands[ 0 ].size() ) );
+
+                    case vop_t::str:
+                        if ( !read( operands[ 0 ], ins, a ) || !read( operands[ 1 ], ins, b ) ||
+                             !read( operands[ 2 ], ins, c ) )
+                            return false;
+                        machine.memory.write( a + b, c, operands[ 2 ].size() );
+                        return true;
+
+                    case vop_t::te:
+                    case vop_t::tne:
+                    case vop_t::tl:
+                    case vop_t::tle:
+                    case vop_t::tul:
+                    case vop_t::tule:
+                    {
+                        if ( !read( operands[ 1 ], ins, a ) || !read( operands[ 2 ], ins, b ) )
+                            return false;
+
+                        const auto bits = operands[ 1 ].bit_count();
+                        bool result = false;
+                        switch ( op )
+                        {
+                        case vop_t::te:
+                            result = a == b;
+                            break;
+                        case vop_t::tne:
+                            result = a != b;
+                            break;
+                        case vop_t::tl:
+                            result = sign_extend( a, bits ) < sign_extend( b, bits );
+                            break;
+                        case vop_t::tle:
+                            result = sign_extend( a, bits ) <= sign_extend( b, bits );
+                            break;
+                        case vop_t::tul:
+                            result = a < b;
+                            break;
+                        default:
+                            result = a <= b;
+                            break;
+                        }
+                        return write( operands[ 0 ], ins, result );
+                    }
+
+                    case vop_t::div:
+                    case vop_t::rem:
+                    {
+                        // op ( hi:lo ), divisor
+                        if ( !read( operands[ 0 ], ins, a ) || !read( operands[ 1 ], ins, b ) ||
+                             !read( operands[ 2 ], ins, c ) )
+                            return false;
+
+                        const auto bits = operands[ 0 ].bit_count();
+                        std::uint64_t quotient, remainder;
+                        if ( bits == 64 )
+                        {
+                            if ( !interpreter::divide( b, a, c, quotient, remainder ) )
+                                return fault();
+                        }
+                        else
+                        {
+                            if ( !c )
+                                return fault();
+
+                            const auto dividend = b << bits | a;
+                            quotient = dividend / c;
+                            remainder = dividend % c;
+                        }
+
+                        return write( operands[ 0 ], ins, op == vop_t::div ? quotient : remainder );
+                    }
+
+                    default:
+                        break;
+                    }
+
+                    // everything left is dst op= src
+                    if ( !read( operands[ 0 ], ins, a ) || !read( operands[ 1 ], ins, b ) )
+                        return false;
+
+                    const auto bits = operands[ 0 ].bit_count();
+                    switch ( op )
+                    {
+                    case vop_t::add:
+                        a += b;
+                        break;
+                    case vop_t::sub:
+                        a -= b;
+                        break;
+                    case vop_t::mul:
+                        a *= b;
+                        break;
+                    case vop_t::mulhi:
+                        a = bits == 64 ? interpreter::multiply_high( a, b ) : ( a * b ) >> bits;
+                        break;
+                    case vop_t::band:
+                        a &= b;
+                        break;
+                    case vop_t::bor:
+                        a |= b;
+                        break;
+                    case vop_t::bxor:
+                        a ^= b;
+                        break;
+                    case vop_t::bshr:
+                        a = b >= static_cast< std::uint64_t >( bits ) ? 0 : a >> b;
+                        break;
+                    case vop_t::bshl:
+                        a = b >= static_cast< std::uint64_t >( bits ) ? 0 : a << b;
+                        break;
+                    default:
+                        return false;
+                    }
+
+                    return write( operands[ 0 ], ins, a );
+                }
+
+                bool fault()
+                {
+                    faulted = true;
+                    return false;
+                }
+
+                machine_t &machine;
+                std::uint64_t sp;
+                std::unordered_map< std::uint64_t, std::uint64_t > temporaries;
+                bool faulted = false;
+            };
+
+            enum class verdict_t
+            {
+                match,
+                mismatch,
+                fault,       // the input makes a handler fault, nothing to compare
+                unsupported, // the block could not be interpreted, lifted or evaluated
+            };
+
+            // a vm context of random bytes and random arithmetic flags, the stack is empty
+            inline machine_t random_machine( std::mt19937_64 &rng )
+            {
+                machine_t machine;
+                for ( auto &byte : machine.context )
+                    byte = static_cast< std::uint8_t >( rng() );
+
+                machine.rflags = ( rng() & 0xcd5 ) | 0x202;
+                return machine;
+            }
+
+            // checks one code block against any number of inputs. the block is decoded, lifted and compiled once.
+            // with lazy_flags the interpreter computes the flags of the handlers as well, see
+            // machine_t::compute_flags. $flags itself is not compared then: after a handler whose flags are dead it
+            // holds whatever the handler before left, only the flags pushed are part of the state
+            class differential_t
+            {
+              public:
+                bool prepare( const vmp2::v3::code_block_t *code_blk, lift_options_t options = {} )
+                {
+                    ready = false;
+                    if ( !interpreter::decode( code_blk, program ) )
+                        return false;
+
+                    compute_flags = options.lazy_flags;
+
+                    std::unique_ptr< vtil::routine > rtn( vtil::basic_block::begin( code_blk->vip_begin )->owner );
+                    if ( !lift( rtn->entry_point, const_cast< vmp2::v3::code_block_t * >( code_blk ), options ) )
+                        return false;
+
+                    if ( !compile( rtn->entry_point, compiled ) )
+                        return false;
+
+                    routine = std::move( rtn );
+                    ready = true;
+                    return true;
+                }
+
+                // expected and actual receive the states the interpreter and the lifted block end in
+                verdict_t check( const machine_t &input, machine_t *expected = nullptr, machine_t *actual = nullptr )
+                {
+                    if ( !ready )
+                        return verdict_t::unsupported;
+
+                    machine_t native = input;
+                    native.compute_flags = compute_flags;
+                    const auto native_status = interpreter::run( program, native );
+                    if ( native_status != status_t::ok )
+                        return native_status == status_t::fault ? verdict_t::fault : verdict_t::unsupported;
+
+                    machine_t lifted = input;
+                    const auto lifted_status = evaluator_t( lifted ).run( compiled );
+                    if ( lifted_status == status_t::unsupported )
+                        return verdict_t::unsupported;
+
+                    if ( compute_flags )
+                        lifted.rflags = native.rflags;
+
+                    const auto verdict =
+                        lifted_status == status_t::ok && lifted == native ? verdict_t::match : verdict_t::mismatch;
+
+                    if ( expected )
+                        *expected = std::move( native );
+                    if ( actual )
+                        *actual = std::move( lifted );
+
+                    return verdict;
+                }
+
+              private:
+                interpreter::program_t program;
+                compiled_block_t compiled;
+
+                // the instructions in compiled point into it
+                std::unique_ptr< vtil::routine > routine;
+                bool compute_flags = false;
+                bool ready = false;
+            };
+
+            struct report_t
+            {
+                std::string name;
+                verdict_t verdict = verdict_t::unsupported;
+
+                // inputs the block was compared on, the ones it faults on are skipped. a fault verdict means it
+                // faulted on every input
+                std::size_t inputs = 0;
+            };
+
+            // runs the block against inputs random machines, mismatch as soon as one of them does not match
+            inline report_t check_block( std::string name, const vmp2::v3::code_block_t *code_blk,
+                                         lift_options_t options, std::size_t inputs, std::mt19937_64 &rng )
+            {
+                report_t report;
+                report.name = std::move( name );
+
+                differential_t differential;
+                if ( !differential.prepare( code_blk, options ) )
+                    return report;
+
+                bool faulted = false;
+                for ( std::size_t input = 0; input < inputs; ++input )
+                {
+                    const auto verdict = differential.check( random_machine( rng ) );
+                    if ( verdict == verdict_t::fault )
+                    {
+                        faulted = true;
+                        continue;
+                    }
+
+                    if ( verdict != verdict_t::match )
+                    {
+                        report.verdict = verdict;
+                        return report;
+                    }
+
+                    ++report.inputs;
+                }
+
+                report.verdict = report.inputs ? verdict_t::match : faulted ? verdict_t::fault : verdict_t::unsupported;
+                return report;
+            }
+
+            // every lifter of LiftersArray in a synthetic::handler_stream of repeat instances
+            inline std::vector< report_t > check_handlers( lift_options_t options, std::size_t repeat = 4,
+                                                           std::size_t inputs = 64, std::uint32_t seed = 0 )
+            {
+                std::mt19937_64 rng( seed );
+                std::vector< report_t > reports;
+
+                for ( const auto &lifter : LiftersArray )
+                {
+                    synthetic::code_block_buffer_t code_blk( synthetic::handler_stream( lifter.mnemonic, repeat, seed ) );
+                    reports.push_back( check_block( "mnemonic_" + std::to_string( static_cast< int >( lifter.mnemonic ) ),
+                                                    code_blk.get(), options, inputs, rng ) );
+                }
+
+                return reports;
+            }
+
+            // every block of synthetic::shift_count_workloads, the counts are constants so a few inputs are enough
+            inline std::vector< report_t > check_shift_counts( lift_options_t options, std::size_t inputs = 4,
+                                                               std::uint32_t seed = 0 )
+            {
+                std::mt19937_64 rng( seed );
+                std::vector< report_t > reports;
+
+                for ( const auto &workload : synthetic::shift_count_workloads( seed ) )
+                {
+                    synthetic::code_block_buffer_t code_blk( workload.vinstrs );
+                    reports.push_back( check_block( workload.name, code_blk.get(), options, inputs, rng ) );
+                }
+
+                return reports;
+            }
+
+            // lifts every block of synthetic::shift_count_workloads with fold_constants and without it and runs both
+            // against the interpreter. returns the blocks where either one is wrong or the two end in different
+            // states, empty if folding a shift and emitting it agree for every count
+            inline std::vector< std::string > check_shift_folding( std::uint32_t seed = 0 )
+            {
+                lift_options_t emitted;
+                emitted.stack_to_temporaries = true;
+
+                auto folded = emitted;
+                folded.fold_constants = true;
+
+                std::vector< std::string > mismatches;
+                for ( const auto &workload : synthetic::shift_count_workloads( seed ) )
+                {
+                    synthetic::code_block_buffer_t code_blk( workload.vinstrs );
+
+                    differential_t folded_check, emitted_check;
+                    machine_t input, folded_state, emitted_state;
+
+                    if ( !folded_check.prepare( code_blk.get(), folded ) ||
+                         !emitted_check.prepare( code_blk.get(), emitted ) ||
+                         folded_check.check( input, nullptr, &folded_state ) != verdict_t::match ||
+                         emitted_check.check( input, nullptr, &emitted_state ) != verdict_t::match ||
+                         !( folded_state == emitted_state ) )
+                        mismatches.push_back( workload.name );
+                }
+
+                return mismatches;
+            }
+
+            inline bool same_block( const vtil::basic_block *a, const vtil::basic_block *b )
+            {
+                return a->size() == b->size() && std::equal( a->begin(), a->end(), b->begin() ) &&
+                       a->sp_offset == b->sp_offset && a->sp_index == b->sp_index &&
+                       a->last_temporary_index == b->last_temporary_index;
+            }
+
+            // lifts the blocks of synthetic::mixed_workloads with incremental_lifter_t, invalidates every other one
+            // and lifts them again, restoring the rest from the cache. returns the blocks where a run differs from
+            // lift_isolated, and "reused" if the second run did not restore exactly the blocks left valid. every
+            // workload has lifters for all of its instructions, a block that fails to lift is reported as well
+            inline std::vector< std::string > check_incremental( lift_options_t options, std::uint32_t seed = 0 )
+            {
+                std::vector< synthetic::code_block_buffer_t > buffers;
+                std::vector< vmp2::v3::code_block_t * > code_blks;
+                for ( const auto &workload : synthetic::mixed_workloads( 4, seed ) )
+                    buffers.emplace_back( workload.vinstrs, 0x1000 * ( buffers.size() + 1 ) );
+                for ( auto &buffer : buffers )
+                    code_blks.push_back( buffer.get() );
+
+                std::unique_ptr< vtil::routine > full( vtil::basic_block::begin( code_blks[ 0 ]->vip_begin )->owner );
+                lift_isolated( full.get(), code_blks, options );
+
+                lift_cache_t cache;
+                incremental_lifter_t incremental( cache, options );
+
+                std::vector< std::string > mismatches;
+                for ( auto run = 0u; run < 2; ++run )
+                {
+                    std::unique_ptr< vtil::routine > rtn( vtil::basic_block::begin( code_blks[ 0 ]->vip_begin )->owner );
+                    const auto stats = incremental.lift( rtn.get(), code_blks );
+
+                    for ( std::size_t idx = 0; idx < code_blks.size(); ++idx )
+                    {
+                        const auto vip = code_blks[ idx ]->vip_begin;
+                        if ( !same_block( rtn->explored_blocks[ vip ], full->explored_blocks[ vip ] ) )
+                            mismatches.push_back( "run_" + std::to_string( run ) + "_" + std::to_string( idx ) );
+
+                        if ( run == 0 && idx % 2 )
+                            incremental.invalidate( vip );
+                    }
+
+                    if ( stats.failed )
+                        mismatches.push_back( "run_" + std::to_string( run ) + "_failed" );
+                    else if ( run == 1 && stats.reused != ( code_blks.size() + 1 ) / 2 )
+                        mismatches.push_back( "reused" );
+                }
+
+                return mismatches;
+            }
+        } // namespace oracle
+    } // namespace lifter_vtil
+} // namespace lifters
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "../common/arena.hpp"
+#include "../common/thread_pool.hpp"
+#include "vtil.hpp"
+
+namespace lifters
+{
+    namespace lifter_vtil
+    {
+        struct lift_task_t
+        {
+            vtil::basic_block *blk;
+            vmp2::v3::code_block_t *code_blk;
+
+            // live vm context of the routine the block belongs to, for coalesce_context
+            const context_liveness_t *context_liveness = nullptr;
+        };
+
+        // lifts every task on a work stealing pool. each block is only ever touched by the thread lifting it and
+        // its contents only depend on its own code block, so the result is identical to lifting them one by one.
+        // every worker keeps a lift context of its own on its own arena for all of the tasks it runs, so workers
+        // never contend on the allocator for lifter state.
+        // if failed is given it is resized to one flag per task, set for the tasks that failed to lift
+        inline bool lift_parallel( const std::vector< lift_task_t > &tasks, lift_options_t options = {},
+                                   unsigned thread_count = default_thread_count(),
+                                   std::vector< std::uint8_t > *failed = nullptr )
+        {
+            if ( failed )
+                failed->assign( tasks.size(), 0 );
+
+            std::deque< arena_t > arenas( std::max( 1u, thread_count ) );
+            std::vector< lift_context_t > contexts;
+            contexts.reserve( arenas.size() );
+            for ( auto &arena : arenas )
+                contexts.emplace_back( nullptr, options, &arena );
+
+            std::atomic_bool success = true;
+
+            parallel_for( tasks.size(), thread_count,
+                          [ & ]( unsigned worker, std::size_t idx )
+                          {
+                              auto &ctx = contexts[ worker ];
+                              ctx.blk = tasks[ idx ].blk;
+                              ctx.context_liveness = tasks[ idx ].context_liveness;
+
+                              if ( lift( &ctx, tasks[ idx ].code_blk ) )
+                                  return;
+
+                              success = false;
+                              if ( failed )
+                                  ( *failed )[ idx ] = 1;
+                          } );
+
+            return success;
+        }
+
+        // adds a task for every code block, creating its block in rtn in the order they are given. code blocks with
+        // the vip_begin of an earlier one are skipped: create_block hands back the block of the first, and two tasks
+        // lifting into one block from two threads would race
+        inline void add_tasks( std::vector< lift_task_t > &tasks, vtil::routine *rtn,
+                               const std::vector< vmp2::v3::code_block_t * > &code_blks,
+                               const context_liveness_t *liveness )
+        {
+            std::unordered_set< vtil::vip_t > scheduled;
+            for ( const auto code_blk : code_blks )
+            {
+                if ( scheduled.insert( code_blk->vip_begin ).second )
+                    tasks.push_back( { rtn->create_block( code_blk->vip_begin ).first, code_blk, liveness } );
+            }
+        }
+
+        // creates a block in rtn for every code block, in the order they are given, then lifts them in parallel.
+        // creating the blocks up front keeps the layout of the routine independent of the thread count
+        inline bool lift_parallel( vtil::routine *rtn, const std::vector< vmp2::v3::code_block_t * > &code_blks,
+                                   lift_options_t options = {}, unsigned thread_count = default_thread_count() )
+        {
+            context_liveness_t liveness;
+            if ( options.coalesce_context )
+                liveness.analyze( code_blks );
+
+            std::vector< lift_task_t > tasks;
+            tasks.reserve( code_blks.size() );
+            add_tasks( tasks, rtn, code_blks, &liveness );
+
+            return lift_parallel( tasks, options, thread_count );
+        }
+
+        // lifts many routines at once, for example every vm entry of a binary
+        inline bool lift_parallel(
+            const std::vector< std::pair< vtil::routine *, std::vector< vmp2::v3::code_block_t * > > > &routines,
+            lift_options_t options = {}, unsigned thread_count = default_thread_count() )
+        {
+            std::deque< context_liveness_t > liveness;
+            std::vector< lift_task_t > tasks;
+            for ( const auto &[ rtn, code_blks ] : routines )
+            {
+                auto &routine_liveness = liveness.emplace_back();
+                if ( options.coalesce_context )
+                    routine_liveness.analyze( code_blks );
+
+                add_tasks( tasks, rtn, code_blks, &routine_liveness );
+            }
+
+            return lift_parallel( tasks, options, thread_count );
+        }
+    } // namespace lifter_vtil
+} // namespace lifters
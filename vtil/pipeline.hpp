@@ -0,0 +1,338 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "../common/arena.hpp"
+#include "../common/mpmc_queue.hpp"
+#include "../common/trace.hpp"
+#include "vtil.hpp"
+
+namespace lifters
+{
+    namespace lifter_vtil
+    {
+        // decode -> lift -> optimize -> emit, every stage on threads of its own with bounded queues in between.
+        // a stage that falls behind fills the queue in front of it and stalls the stages before it, so the number
+        // of blocks in flight never exceeds the capacity of the queues plus one per thread
+        namespace pipeline
+        {
+            enum stage_id_t : unsigned
+            {
+                decode_stage,
+                lift_stage,
+                optimize_stage,
+                emit_stage,
+                stage_count
+            };
+
+            constexpr const char *stage_names[ stage_count ] = { "decode", "lift", "optimize", "emit" };
+
+            // optimizing is by far the slowest stage, it gets every core the others do not need
+            inline unsigned default_optimize_threads()
+            {
+                const auto cores = std::thread::hardware_concurrency();
+                return cores > 4 ? cores - 3 : 1;
+            }
+
+            struct config_t
+            {
+                lift_options_t options;
+                unsigned threads[ stage_count ] = { 1, 2, default_optimize_threads(), 1 };
+                std::size_t queue_capacity = 64;
+                bool optimize = true;
+            };
+
+            struct stage_stats_t
+            {
+                unsigned threads = 0;
+                std::uint64_t items = 0;
+                double busy_seconds = 0.0;
+                double wait_seconds = 0.0;
+
+                // share of the stage's thread time spent working instead of waiting on its queues
+                double utilization() const
+                {
+                    const auto total = busy_seconds + wait_seconds;
+                    return total ? busy_seconds / total : 0.0;
+                }
+            };
+
+            struct stats_t
+            {
+                stage_stats_t stages[ stage_count ];
+                std::uint64_t blocks = 0;
+                std::uint64_t failed = 0;
+                double wall_seconds = 0.0;
+            };
+
+            inline void write_json( std::ostream &out, const stats_t &stats )
+            {
+                out << "{\"blocks\":" << stats.blocks << ",\"failed\":" << stats.failed
+                    << ",\"wall_seconds\":" << stats.wall_seconds << ",\"stages\":[";
+
+                for ( unsigned stage = 0; stage < stage_count; ++stage )
+                {
+                    const auto &s = stats.stages[ stage ];
+                    out << ( stage ? "," : "" ) << "{\"stage\":\"" << stage_names[ stage ] << "\",\"threads\":" << s.threads
+                        << ",\"items\":" << s.items << ",\"busy_seconds\":" << s.busy_seconds
+                        << ",\"wait_seconds\":" << s.wait_seconds << ",\"utilization\":" << s.utilization() << "}";
+                }
+
+                out << "]}\n";
+            }
+
+            // returns the next code block or nullptr once there are none left. must be thread safe when the decode
+            // stage runs on more than one thread
+            using source_fn_t = std::function< vmp2::v3::code_block_t *() >;
+
+            // called with every lifted (and optimized) block, the routine is destroyed as soon as it returns.
+            // blocks arrive in no particular order. must be thread safe when the emit stage runs on more than one
+            // thread. returning false stops the pipeline
+            using emit_fn_t = std::function< bool( const vmp2::v3::code_block_t *code_blk, vtil::routine *rtn ) >;
+
+            namespace detail
+            {
+                using clock = std::chrono::steady_clock;
+
+                struct item_t
+                {
+                    vmp2::v3::code_block_t *code_blk;
+                    vtil::routine *rtn;
+                    bool lifted;
+                };
+
+                struct stage_t
+                {
+                    std::atomic< unsigned > running = 0;
+                    std::atomic_bool finished = false;
+                    std::atomic< std::uint64_t > items = 0;
+                    std::atomic< std::uint64_t > busy_ns = 0;
+                    std::atomic< std::uint64_t > wait_ns = 0;
+
+                    void leave()
+                    {
+                        if ( running.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+                            finished.store( true, std::memory_order_release );
+                    }
+                };
+
+                inline std::uint64_t elapsed_ns( clock::time_point begin )
+                {
+                    return std::chrono::duration_cast< std::chrono::nanoseconds >( clock::now() - begin ).count();
+                }
+
+                // pops from the queue of the stage before, returns false once that stage is done and its queue drained
+                inline bool pop( mpmc_queue_t< item_t * > &queue, const stage_t &upstream, item_t *&item )
+                {
+                    for ( unsigned spins = 0;; ++spins )
+                    {
+                        if ( queue.try_pop( item ) )
+                            return true;
+
+                        // everything upstream pushed is visible once finished is, so one last try settles it
+                        if ( upstream.finished.load( std::memory_order_acquire ) )
+                            return queue.try_pop( item );
+
+                        mpmc_queue_t< item_t * >::backoff( spins );
+                    }
+                }
+
+                // runs work on every item from in and forwards it to out
+                template < class F >
+                void run_stage( stage_t &self, mpmc_queue_t< item_t * > &in, const stage_t &upstream,
+                                mpmc_queue_t< item_t * > *out, F &&work )
+                {
+                    std::uint64_t busy = 0, wait = 0, items = 0;
+
+                    for ( ;; )
+                    {
+                        auto begin = clock::now();
+                        item_t *item;
+                        const bool popped = pop( in, upstream, item );
+                        wait += elapsed_ns( begin );
+                        if ( !popped )
+                            break;
+
+                        begin = clock::now();
+                        work( item );
+                        busy += elapsed_ns( begin );
+                        ++items;
+
+                        if ( out )
+                        {
+                            begin = clock::now();
+                            out->push( item );
+                            wait += elapsed_ns( begin );
+                        }
+                    }
+
+                    self.items += items;
+                    self.busy_ns += busy;
+                    self.wait_ns += wait;
+                    self.leave();
+                }
+            } // namespace detail
+
+            inline bool run( const source_fn_t &source, const emit_fn_t &emit, const config_t &config = {},
+                             stats_t *stats = nullptr )
+            {
+                using namespace detail;
+
+                mpmc_queue_t< item_t * > decoded( config.queue_capacity ), lifted( config.queue_capacity ),
+                    optimized( config.queue_capacity );
+
+                stage_t stages[ stage_count ];
+                std::atomic_bool stop = false;
+                std::atomic< std::uint64_t > failed = 0;
+
+                unsigned threads[ stage_count ];
+                for ( unsigned stage = 0; stage < stage_count; ++stage )
+                {
+                    threads[ stage ] = std::max( 1u, config.threads[ stage ] );
+                    stages[ stage ].running = threads[ stage ];
+                }
+
+                const auto begin = clock::now();
+                std::vector< std::thread > workers;
+
+                for ( unsigned thread = 0; thread < threads[ decode_stage ]; ++thread )
+                {
+                    workers.emplace_back(
+                        [ & ]
+                        {
+                            auto &self = stages[ decode_stage ];
+                            std::uint64_t busy = 0, wait = 0, items = 0;
+
+                            while ( !stop.load( std::memory_order_relaxed ) )
+                            {
+                                auto start = clock::now();
+                                vmp2::v3::code_block_t *code_blk;
+                                {
+                                    LIFTERS_SPAN( "decode_block", "decode", items );
+                                    code_blk = source();
+                                }
+                                busy += elapsed_ns( start );
+                                if ( !code_blk )
+                                    break;
+
+                                ++items;
+                                start = clock::now();
+                                decoded.push( new item_t{ code_blk, nullptr, false } );
+                                wait += elapsed_ns( start );
+                            }
+
+                            self.items += items;
+                            self.busy_ns += busy;
+                            self.wait_ns += wait;
+                            self.leave();
+                        } );
+                }
+
+                for ( unsigned thread = 0; thread < threads[ lift_stage ]; ++thread )
+                {
+                    workers.emplace_back(
+                        [ & ]
+                        {
+                            arena_t arena;
+
+                            run_stage( stages[ lift_stage ], decoded, stages[ decode_stage ], &lifted,
+                                       [ & ]( item_t *item )
+                                       {
+                                           auto blk = vtil::basic_block::begin( item->code_blk->vip_begin );
+                                           item->rtn = blk->owner;
+
+                                           // one context per item, it has to be gone before the arena is reset
+                                           {
+                                               lift_context_t ctx( blk, config.options, &arena );
+                                               item->lifted = lifter_vtil::lift( &ctx, item->code_blk );
+                                           }
+                                           arena.reset();
+
+                                           if ( !item->lifted )
+                                               ++failed;
+                                       } );
+                        } );
+                }
+
+                for ( unsigned thread = 0; thread < threads[ optimize_stage ]; ++thread )
+                {
+                    workers.emplace_back(
+                        [ & ]
+                        {
+                            run_stage( stages[ optimize_stage ], lifted, stages[ lift_stage ], &optimized,
+                                       [ & ]( item_t *item )
+                                       {
+                                           if ( config.optimize && item->lifted && !stop.load( std::memory_order_relaxed ) )
+                                               vtil::optimizer::apply_all( item->rtn );
+                                       } );
+                        } );
+                }
+
+                for ( unsigned thread = 0; thread < threads[ emit_stage ]; ++thread )
+                {
+                    workers.emplace_back(
+                        [ & ]
+                        {
+                            run_stage( stages[ emit_stage ], optimized, stages[ optimize_stage ], nullptr,
+                                       [ & ]( item_t *item )
+                                       {
+                                           // keep draining after a stop so every routine in flight gets freed
+                                           if ( item->lifted && !stop.load( std::memory_order_relaxed ) &&
+                                                !emit( item->code_blk, item->rtn ) )
+                                               stop = true;
+
+                                           delete item->rtn;
+                                           delete item;
+                                       } );
+                        } );
+                }
+
+                for ( auto &worker : workers )
+                    worker.join();
+
+                if ( stats )
+                {
+                    for ( unsigned stage = 0; stage < stage_count; ++stage )
+                    {
+                        auto &s = stats->stages[ stage ];
+                        s.threads = threads[ stage ];
+                        s.items = stages[ stage ].items;
+                        s.busy_seconds = stages[ stage ].busy_ns * 1e-9;
+                        s.wait_seconds = stages[ stage ].wait_ns * 1e-9;
+                    }
+
+                    stats->blocks = stages[ lift_stage ].items;
+                    stats->failed = failed;
+                    stats->wall_seconds = std::chrono::duration< double >( clock::now() - begin ).count();
+                }
+
+                return !stop;
+            }
+
+            // runs the pipeline over a memory mapped vmp2 v3 trace
+            inline bool run( const char *trace_path, const emit_fn_t &emit, const config_t &config = {},
+                             stats_t *stats = nullptr )
+            {
+                trace_reader_t reader;
+                if ( !reader.open( trace_path ) )
+                    return false;
+
+                std::mutex mutex;
+                return run(
+                    [ & ]
+                    {
+                        std::lock_guard< std::mutex > lock( mutex );
+                        return reader.next();
+                    },
+                    emit, config, stats );
+            }
+        } // namespace pipeline
+    } // namespace lifter_vtil
+} // namespace lifters
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <memory>
+
+#include "../common/arena.hpp"
+#include "../common/trace.hpp"
+#include "vtil.hpp"
+
+namespace lifters
+{
+    namespace lifter_vtil
+    {
+        struct stream_stats_t
+        {
+            std::size_t blocks = 0;
+            std::size_t failed = 0;
+            std::size_t bytes = 0;
+        };
+
+        // called with every lifted block, the routine is destroyed as soon as it returns. returning false stops
+        // the stream
+        using emit_fn_t = std::function< bool( const vmp2::v3::code_block_t *code_blk, vtil::routine *rtn ) >;
+
+        // lifts a vmp2 v3 trace straight from a memory mapping, one code block at a time. every block is lifted
+        // into a routine of its own, handed to emit and freed before the next block is read, and the pages of the
+        // trace behind it are released, so memory use does not grow with the size of the trace.
+        // blocks without a lifter for one of their instructions are counted and skipped
+        inline bool lift_stream( const char *trace_path, const emit_fn_t &emit, lift_options_t options = {},
+                                 stream_stats_t *stats = nullptr )
+        {
+            trace_reader_t reader;
+            if ( !reader.open( trace_path ) )
+                return false;
+
+            stream_stats_t result;
+            arena_t arena;
+
+            bool completed = true;
+            for ( ;; )
+            {
+                vmp2::v3::code_block_t *code_blk;
+                {
+                    LIFTERS_SPAN( "decode_block", "decode", result.blocks );
+                    code_blk = reader.next();
+                }
+                if ( !code_blk )
+                    break;
+
+                std::unique_ptr< vtil::routine > rtn( vtil::basic_block::begin( code_blk->vip_begin )->owner );
+
+                ++result.blocks;
+                bool lifted;
+                {
+                    // the context keeps its state in the arena, it has to be gone before the arena is reset
+                    lift_context_t ctx( rtn->entry_point, options, &arena );
+                    lifted = lift( &ctx, code_blk );
+                }
+                arena.reset();
+
+                if ( !lifted )
+                    ++result.failed;
+                else if ( !emit( code_blk, rtn.get() ) )
+                {
+                    completed = false;
+                    break;
+                }
+
+                rtn.reset();
+                reader.release_consumed();
+            }
+
+            result.bytes = reader.bytes_consumed();
+            if ( stats )
+                *stats = result;
+
+            return completed;
+        }
+
+        // writes every lifted block to <directory>/<vip>.vtil
+        inline bool lift_stream( const char *trace_path, const std::filesystem::path &directory,
+                                 lift_options_t options = {}, stream_stats_t *stats = nullptr )
+        {
+            std::error_code ec;
+            std::filesystem::create_directories( directory, ec );
+
+            return lift_stream(
+                trace_path,
+                [ & ]( const vmp2::v3::code_block_t *code_blk, vtil::routine *rtn )
+                {
+                    char name[ 32 ];
+                    std::snprintf( name, sizeof( name ), "%llx.vtil",
+                                   static_cast< unsigned long long >( code_blk->vip_begin ) );
+
+                    vtil::save_routine( rtn, directory / name );
+                    return true;
+                },
+                options, stats );
+        }
+    }; // namespace lifter_vtil
+} // namespace lifters
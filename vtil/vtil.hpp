@@ -1,12 +1,23 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <variant>
+#include <vector>
 #include <vmctx.hpp>
 #include <vmprofiles.hpp>
 #include <vtil/amd64>
 #include <vtil/vtil>
 
+#include "../common/analysis.hpp"
+#include "../common/arena.hpp"
+#include "../common/idioms.hpp"
+#include "../common/instrumentation.hpp"
+
 static constexpr vtil::register_desc FLAG_CF = vtil::REG_FLAGS.select( 1, 0 );
 static constexpr vtil::register_desc FLAG_PF = vtil::REG_FLAGS.select( 1, 2 );
 static constexpr vtil::register_desc FLAG_AF = vtil::REG_FLAGS.select( 1, 4 );
@@ -27,449 +38,945 @@ namespace lifters
     namespace lifter_vtil
     {
 
+        // options that change what the lifters emit, all off by default. they are part of the lift cache key
+        struct lift_options_t
+        {
+            // keep values pushed on the virtual stack in temporaries for as long as the stack depth of the code
+            // block is known, instead of emitting a str/ldd against $sp for every push and pop
+            bool stack_to_temporaries = false;
+
+            // only compute the flags of a handler when something in the code block can read them, and compute
+            // them from the operation that produced them. dead flags are pushed as undefined
+            bool lazy_flags = false;
+
+            // lift the nand/add sequences vmprotect uses for not/and/or/xor/sub as a single operation,
+            // see common/idioms.hpp
+            bool recognize_idioms = false;
+
+            // keep vm registers that are overwritten before they are read and dead once the block is left in
+            // temporaries instead of virtual registers, see context_liveness_t. needs lift_context_t::context_liveness
+            bool coalesce_context = false;
+
+            // evaluate handlers whose inputs are constants pushed in the same code block at lift time, fold
+            // constant offsets into the addresses of reads and writes and skip moves of undefined values. only has
+            // an effect with stack_to_temporaries, offsets are only folded where lazy_flags proves the flags dead
+            bool fold_constants = false;
+
+            // identifies the options in cache keys, every option that changes the output has to be part of it
+            std::uint32_t key() const
+            {
+                return ( stack_to_temporaries ? 1u : 0u ) | ( lazy_flags ? 2u : 0u ) | ( recognize_idioms ? 4u : 0u ) |
+                       ( coalesce_context ? 8u : 0u ) | ( fold_constants ? 16u : 0u );
+            }
+        };
+
+        // the operation a handler recorded for the flags it pushes, see lift_context_t::record_flags
+        enum class flags_op_t
+        {
+            none,
+            add,
+            logic,
+            shift,
+            mul,
+        };
+
+        // per code block lifting state, every push and pop of a lifter goes through here.
+        // the state is allocated from resource, pass an arena_t to keep the lifter off the heap
+        class lift_context_t
+        {
+          public:
+            explicit lift_context_t( vtil::basic_block *blk, lift_options_t options = {},
+                                     std::pmr::memory_resource *resource = std::pmr::get_default_resource() )
+                : blk( blk ), options( options ), slots( resource ), displacements( resource ), flags_live( resource )
+            {
+            }
+
+            vtil::basic_block *blk;
+            lift_options_t options;
+
+            // live vm context of the routine being lifted, only used with coalesce_context
+            const context_liveness_t *context_liveness = nullptr;
+
+            // index of the virtual instruction being lifted inside the code block
+            std::size_t vinstr_index = 0;
+
+            // called by the driver before the first virtual instruction of a code block
+            void begin_block( const vmp2::v3::code_block_t *code_blk )
+            {
+                vinstr_index = 0;
+                if ( options.lazy_flags )
+                    flags_liveness( code_blk, flags_live );
+                else
+                    flags_live.clear();
+
+                coalesced = coalesced_granules( code_blk );
+                allocated = 0;
+            }
+
+            // the granules of the vm context the code block keeps in temporaries, zero unless coalescing
+            std::uint32_t coalesced_granules( const vmp2::v3::code_block_t *code_blk ) const
+            {
+                if ( !options.coalesce_context || !context_liveness )
+                    return 0;
+
+                const auto live_out = context_liveness->live_out( code_blk->vip_begin );
+                return live_out ? coalescible_granules( code_blk, *live_out ) : 0;
+            }
+
+            // the register sreg/lreg handlers access, the virtual register or the temporary standing in for it
+            vtil::register_desc context_register( std::uint64_t context_offset, std::uint8_t size )
+            {
+                const auto granule = static_cast< unsigned >( context_offset / 8 ) & 31;
+                if ( !( coalesced & ( 1u << granule ) ) )
+                    return make_virtual_register( context_offset, size );
+
+                if ( !( allocated & ( 1u << granule ) ) )
+                {
+                    granule_ids[ granule ] = blk->tmp( 64 ).local_id;
+                    allocated |= 1u << granule;
+                }
+
+                return vtil::register_desc( vtil::register_local, granule_ids[ granule ], size * 8,
+                                            static_cast< vtil::bitcnt_t >( context_offset % 8 ) * 8 );
+            }
+
+            lift_context_t *push( const vtil::operand &op )
+            {
+                if ( !options.stack_to_temporaries || is_stack_pointer( op ) )
+                {
+                    flush();
+                    blk->push( op );
+                    return this;
+                }
+
+                // immediates and temporaries cannot change before they are popped, anything else is copied
+                if ( op.is_immediate() || op.reg().is_local() || op.reg().is_undefined() )
+                    slots.push_back( op );
+                else
+                {
+                    auto value = blk->tmp( op.bit_count() );
+                    blk->mov( value, op );
+                    slots.push_back( value );
+                }
+
+                displacements.push_back( 0 );
+                return this;
+            }
+
+            lift_context_t *pop( const vtil::operand &op )
+            {
+                // popping below the values pushed in this block or with a different width than the one pushed means
+                // the layout of the stack is not known here, so fall back to the real stack
+                if ( !options.stack_to_temporaries || is_stack_pointer( op ) || slots.empty() ||
+                     slots.back().bit_count() != op.bit_count() )
+                {
+                    flush();
+                    blk->pop( op );
+                    return this;
+                }
+
+                const auto &slot = slots.back();
+                const auto displacement = displacements.back();
+
+                // whatever the register held before is as good as an undefined value
+                if ( !options.fold_constants || !slot.is_register() || !slot.reg().is_undefined() )
+                    blk->mov( op, slot );
+                if ( displacement )
+                    blk->add( op, vtil::make_imm( displacement ) );
+
+                slots.pop_back();
+                displacements.pop_back();
+                return this;
+            }
+
+            // the value depth slots below the top of the stack if it is a constant pushed in this block with a
+            // width of bits, only with fold_constants
+            std::optional< std::uint64_t > constant( vtil::bitcnt_t bits, std::size_t depth = 0 ) const
+            {
+                if ( !options.fold_constants || !options.stack_to_temporaries || depth >= slots.size() )
+                    return std::nullopt;
+
+                const auto &slot = slots[ slots.size() - 1 - depth ];
+                if ( !slot.is_immediate() || slot.bit_count() != bits )
+                    return std::nullopt;
+
+                return slot.imm().u64;
+            }
+
+            // removes the top slot without emitting anything, for values constant() returned
+            lift_context_t *drop()
+            {
+                slots.pop_back();
+                displacements.pop_back();
+                return this;
+            }
+
+            // adds the constant at depth ( 0 or 1 ) to the other of the two slots on top of the stack and removes
+            // it, leaving the sum on top. only possible if the other slot is a 64 bit temporary, false otherwise
+            bool displace( std::uint64_t value, std::size_t depth )
+            {
+                if ( !options.fold_constants || slots.size() < 2 )
+                    return false;
+
+                const auto other = slots.size() - 2 + depth;
+                const auto &slot = slots[ other ];
+                if ( !slot.is_register() || !slot.reg().is_local() || slot.bit_count() != 64 )
+                    return false;
+
+                const auto target = slots[ other ];
+                const auto displacement = displacements[ other ] + static_cast< std::int64_t >( value );
+                drop()->drop();
+
+                slots.push_back( target );
+                displacements.push_back( displacement );
+                return true;
+            }
+
+            // pops a 64 bit address as a base register and an offset for ldd/str. a temporary with a displacement
+            // is used as the base directly, anything else is popped into a new temporary
+            std::pair< vtil::operand, std::int64_t > pop_address()
+            {
+                if ( options.fold_constants && options.stack_to_temporaries && !slots.empty() &&
+                     slots.back().is_register() && slots.back().reg().is_local() && slots.back().bit_count() == 64 )
+                {
+                    const std::pair< vtil::operand, std::int64_t > address = { slots.back(), displacements.back() };
+                    drop();
+                    return address;
+                }
+
+                auto base = blk->tmp( 64 );
+                pop( base );
+                return { base, 0 };
+            }
+
+            // result is the value the flags describe. operand is the right hand side for add, the high half of the
+            // product for mul and the masked count for shifts
+            lift_context_t *record_flags( flags_op_t op, const vtil::operand &result, const vtil::operand &operand = {} )
+            {
+                flags = { op, result, operand };
+                return this;
+            }
+
+            lift_context_t *pushf()
+            {
+                if ( !options.lazy_flags )
+                    return push( vtil::REG_FLAGS );
+
+                if ( vinstr_index < flags_live.size() && !flags_live[ vinstr_index ] )
+                {
+                    flags = {};
+                    return push( vtil::UNDEFINED );
+                }
+
+                materialize_flags();
+                return push( vtil::REG_FLAGS );
+            }
+
+            lift_context_t *popf()
+            {
+                return pop( vtil::REG_FLAGS );
+            }
+
+            // writes every value still held in a temporary to the real stack, the driver calls this at the end of
+            // the code block so the stack is in the state the next block expects
+            lift_context_t *flush()
+            {
+                for ( std::size_t idx = 0; idx < slots.size(); ++idx )
+                {
+                    if ( !displacements[ idx ] )
+                    {
+                        blk->push( slots[ idx ] );
+                        continue;
+                    }
+
+                    auto value = blk->tmp( 64 );
+                    blk->mov( value, slots[ idx ] )->add( value, vtil::make_imm( displacements[ idx ] ) );
+                    blk->push( value );
+                }
+
+                slots.clear();
+                displacements.clear();
+                return this;
+            }
+
+            std::size_t depth() const
+            {
+                return slots.size();
+            }
+
+            bool is_flags_live( std::size_t idx ) const
+            {
+                return !options.lazy_flags || idx >= flags_live.size() || flags_live[ idx ];
+            }
+
+          private:
+            struct pending_flags_t
+            {
+                flags_op_t op = flags_op_t::none;
+                vtil::operand result;
+                vtil::operand operand;
+            };
+
+            void materialize_flags()
+            {
+                const auto [ op, result, operand ] = flags;
+                flags = {};
+
+                if ( op == flags_op_t::none )
+                    return;
+
+                const auto bits = result.bit_count();
+                const auto zero = vtil::operand( 0, bits );
+
+                // a shift by zero leaves the flags alone, with a count only known at run time zf and sf become
+                // ( flag & count == 0 ) | ( new & count != 0 )
+                if ( op == flags_op_t::shift && operand.is_register() )
+                {
+                    auto [ shifted, zf, sf ] = blk->tmp( 1, 1, 1 );
+                    blk->tne( shifted, operand, vtil::operand( 0, operand.bit_count() ) )
+                        ->te( zf, result, zero )
+                        ->band( zf, shifted )
+                        ->tl( sf, result, zero )
+                        ->band( sf, shifted )
+                        ->bnot( shifted )
+                        ->band( FLAG_ZF, shifted )
+                        ->bor( FLAG_ZF, zf )
+                        ->band( FLAG_SF, shifted )
+                        ->bor( FLAG_SF, sf );
+                    return;
+                }
+
+                blk->te( FLAG_ZF, result, zero );
+                blk->tl( FLAG_SF, result, zero );
+
+                switch ( op )
+                {
+                case flags_op_t::add:
+                {
+                    // lhs = result - operand is only rebuilt here so add does not have to keep a copy
+                    auto [ lhs, overflow, t0 ] = blk->tmp( bits, bits, bits );
+                    blk->tul( FLAG_CF, result, operand );
+
+                    // of := sign( ( lhs ^ result ) & ( operand ^ result ) )
+                    blk->mov( lhs, result )
+                        ->sub( lhs, operand )
+                        ->mov( overflow, lhs )
+                        ->bxor( overflow, result )
+                        ->mov( t0, operand )
+                        ->bxor( t0, result )
+                        ->band( overflow, t0 )
+                        ->tl( FLAG_OF, overflow, zero );
+                    break;
+                }
+                case flags_op_t::logic:
+                    blk->mov( FLAG_CF, vtil::operand( 0, 1 ) )->mov( FLAG_OF, vtil::operand( 0, 1 ) );
+                    break;
+                case flags_op_t::mul:
+                    blk->tne( FLAG_CF, operand, zero )->mov( FLAG_OF, FLAG_CF );
+                    break;
+                default:
+                    // cf/of of shifts depend on the count, they keep their previous value
+                    break;
+                }
+            }
+
+            static bool is_stack_pointer( const vtil::operand &op )
+            {
+                return op.is_register() && op.reg().is_stack_pointer();
+            }
+
+            // values pushed in this block that have not been written to the real stack, back() is the top
+            std::pmr::vector< vtil::operand > slots;
+
+            // constant added to the slot with the same index, always a 64 bit temporary when not zero
+            std::pmr::vector< std::int64_t > displacements;
+
+            pending_flags_t flags;
+            std::pmr::vector< bool > flags_live;
+
+            // coalesced granules and the ones a temporary was made for yet
+            std::uint32_t coalesced = 0;
+            std::uint32_t allocated = 0;
+            std::array< std::uint64_t, 32 > granule_ids = {};
+        };
+
+        // plain function pointer so every lifter can be placed in a constexpr dispatch table,
+        // captureless lambdas convert to this implicitly
+        using lift_fn_t = void ( * )( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                      vmp2::v3::code_block_t *code_blk );
+
         struct lifter_t
         {
             vm::handler::mnemonic_t mnemonic;
-            std::function< void( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                 vmp2::v3::code_block_t *code_blk ) >
-                func;
+            lift_fn_t func;
         };
 
-        lifter_t lconstbzxq = { vm::handler::LCONSTBSXQ, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                             vmp2::v3::code_block_t *code_blk )
-                                {
-                                    int32_t t = ( int32_t )vinstr->operand.imm.u; // ض
-                                    // չ?
-                                    blk->push( vtil::operand( static_cast< int64_t >( t ), 64 ) );
-                                } };
+        // each operation family is written once and instantiated for every operand width the vm uses,
+        // N is the width of the operand in bits
 
-        lifter_t lconstq = {
-            // push imm<N>
-            vm::handler::LCONSTQ,
-            []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-            { blk->push( vtil::operand( vinstr->operand.imm.u, 64 ) ); } };
+        constexpr std::uint64_t width_mask( vtil::bitcnt_t bits )
+        {
+            return bits >= 64 ? ~0ull : ( 1ull << bits ) - 1;
+        }
 
-        lifter_t lconstdw = {
-            // push imm<N>
-            vm::handler::LCONSTDW,
-            []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-            { blk->push( vtil::operand( vinstr->operand.imm.u, 32 ) ); } };
+        template < vtil::bitcnt_t N > constexpr std::uint64_t width_mask()
+        {
+            return width_mask( N );
+        }
 
-        lifter_t lconstw = {
+        template < vtil::bitcnt_t N >
+        void lift_lconst( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
             // push imm<N>
-            vm::handler::LCONSTW,
-            []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-            { blk->push( vtil::operand( vinstr->operand.imm.u, 16 ) ); } };
+            ctx->push( vtil::operand( vinstr->operand.imm.u & width_mask< N >(), N ) );
+        }
 
-        lifter_t lconstb2w = {
-            // push imm<N>
-            vm::handler::LCONSTB2W,
-            []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-            { blk->push( vtil::operand( vinstr->operand.imm.u, 16 ) ); } };
-
-        lifter_t lconstbzxw{ vm::handler::LCONSTBZXW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                          vmp2::v3::code_block_t *code_blk )
-                             { blk->push( vtil::operand( vinstr->operand.imm.u, 16 ) ); } };
-
-        lifter_t lconstwsxq{ vm::handler::LCONSTWSXQ, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                          vmp2::v3::code_block_t *code_blk )
-                             { blk->push( vtil::operand( vinstr->operand.imm.u, 64 ) ); } };
-
-        lifter_t sregq = { vm::handler::SREGQ, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                   vmp2::v3::code_block_t *code_blk )
-                           { blk->pop( make_virtual_register( vinstr->operand.imm.u, 8 ) ); } };
-
-        lifter_t sregdw = { vm::handler::SREGDW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                     vmp2::v3::code_block_t *code_blk )
-                            { blk->pop( make_virtual_register( vinstr->operand.imm.u, 4 ) ); } };
-
-        lifter_t sregw = { vm::handler::SREGW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                   vmp2::v3::code_block_t *code_blk )
-                           {
-                               // mov     dx, [rbp+0]
-                               // mov     [rax+rdi], dx
-                               blk->pop( make_virtual_register( vinstr->operand.imm.u, 2 ) );
-                           } };
-
-        lifter_t sregb = { vm::handler::SREGB, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                   vmp2::v3::code_block_t *code_blk )
-                           { blk->pop( make_virtual_register( vinstr->operand.imm.u, 1 ) ); } };
-
-        lifter_t addq = { vm::handler::ADDQ, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                 vmp2::v3::code_block_t *code_blk )
-                          {
-                              auto [ t0, t1 ] = blk->tmp( 64, 64 );
-                              blk->pop( t0 );
-                              blk->pop( t1 );
-                              blk->add( t1, t0 );
-                              blk->push( t1 )->pushf();
-                          } };
-
-        lifter_t addw = { vm::handler::ADDW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                 vmp2::v3::code_block_t *code_blk )
-                          {
-                              auto [ t0, t1 ] = blk->tmp( 16, 16 );
-                              blk->pop( t0 );
-                              blk->pop( t1 );
-                              blk->add( t1, t0 );
-                              blk->push( t1 )->pushf();
-                          } };
-
-        lifter_t adddw = { vm::handler::ADDDW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                   vmp2::v3::code_block_t *code_blk )
-                           {
-                               auto [ t0, t1 ] = blk->tmp( 32, 32 );
-                               blk->pop( t0 );
-                               blk->pop( t1 );
-                               blk->add( t1, t0 );
-                               blk->push( t1 )->pushf();
-                           } };
-
-        lifter_t addb = { vm::handler::ADDB, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                 vmp2::v3::code_block_t *code_blk )
-                          {
-                              auto [ t0, t1 ] = blk->tmp( 8, 8 );
-                              blk->pop( t0 );
-                              blk->pop( t1 );
-                              blk->add( t1, t0 );
-                              blk->push( t1 )->pushf();
-                          } };
-
-        lifter_t lregq = {
-            vm::handler::LREGQ,
-            []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        // lconst variants that extend an immediate of From bits to N bits
+        template < vtil::bitcnt_t N, vtil::bitcnt_t From, bool Signed >
+        void lift_lconst_extend( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto value = vinstr->operand.imm.u & width_mask< From >();
+            if ( Signed && ( value >> ( From - 1 ) & 1 ) )
+                value |= ~width_mask< From >();
+
+            ctx->push( vtil::operand( value & width_mask< N >(), N ) );
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_sreg( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            // mov     dx, [rbp+0]
+            // mov     [rax+rdi], dx
+            ctx->pop( ctx->context_register( vinstr->operand.imm.u, N / 8 ) );
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_lreg( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto stack_top_value = ctx->blk->tmp( N );
+            ctx->blk->mov( stack_top_value, ctx->context_register( vinstr->operand.imm.u, N / 8 ) );
+            ctx->push( stack_top_value );
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_add( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            const auto lhs = ctx->constant( N, 0 ), rhs = ctx->constant( N, 1 );
+            if ( lhs && rhs )
+            {
+                const auto result = vtil::operand( ( *lhs + *rhs ) & width_mask< N >(), N );
+                ctx->drop()->drop();
+                ctx->record_flags( flags_op_t::add, result, vtil::operand( *lhs, N ) );
+                ctx->push( result )->pushf();
+                return;
+            }
+
+            // address arithmetic, the flags are never read
+            if ( N == 64 && ( lhs || rhs ) && !ctx->is_flags_live( ctx->vinstr_index ) &&
+                 ctx->displace( lhs ? *lhs : *rhs, lhs ? 0 : 1 ) )
+            {
+                ctx->pushf();
+                return;
+            }
+
+            auto [ t0, t1 ] = ctx->blk->tmp( N, N );
+            ctx->pop( t0 );
+            ctx->pop( t1 );
+            ctx->blk->add( t1, t0 );
+            ctx->record_flags( flags_op_t::add, t1, t0 );
+            ctx->push( t1 )->pushf();
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_nand( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            const auto lhs = ctx->constant( N, 0 ), rhs = ctx->constant( N, 1 );
+            if ( lhs && rhs )
             {
-                auto stack_top_value = blk->tmp( 64 );                                          // ջϵֵ
-                blk->mov( stack_top_value, make_virtual_register( vinstr->operand.imm.u, 8 ) ); // Ĵ8ֽ
-                blk->push( stack_top_value );
-            } };
-        lifter_t lregdw = { vm::handler::LREGDW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                     vmp2::v3::code_block_t *code_blk )
-                            {
-                                auto stack_top_value = blk->tmp( 32 ); // ջϵֵ
-                                blk->mov( stack_top_value, make_virtual_register( vinstr->operand.imm.u, 4 ) );
-                                blk->push( stack_top_value );
-                            } };
-
-        lifter_t lregw = { vm::handler::LREGW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                   vmp2::v3::code_block_t *code_blk )
-                           {
-                               auto stack_top_value = blk->tmp( 16 ); // ջϵֵ
-                               blk->mov( stack_top_value, make_virtual_register( vinstr->operand.imm.u, 2 ) );
-                               blk->push( stack_top_value );
-                           } };
-
-        lifter_t readq{ vm::handler::READQ,
-                        []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                        {
-                            auto [ t0, t1 ] = blk->tmp( 64, 64 );
-                            blk->pop( t0 );
-                            blk->ldd( t1, t0, vtil::make_imm( 0ull ) );
-                            blk->push( t1 );
-                        } };
-
-        lifter_t readdw{ vm::handler::READDW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                  vmp2::v3::code_block_t *code_blk )
-                         {
-                             auto [ t0, t1 ] = blk->tmp( 64, 32 );
-                             blk->pop( t0 );
-                             blk->ldd( t1, t0, vtil::make_imm( 0ull ) );
-                             blk->push( t1 );
-                         } };
-
-        lifter_t readw{ vm::handler::READW,
-                        []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                        {
-                            auto [ t0, t1 ] = blk->tmp( 64, 16 );
-                            blk->pop( t0 ); // óַ
-                            blk->ldd( t1, t0, vtil::make_imm( 0ull ) );
-                            blk->push( t1 );
-                        } };
-
-        lifter_t readb{ vm::handler::READB,
-                        []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                        {
-                            auto [ t0, t1 ] = blk->tmp( 64, 8 );
-                            blk->pop( t0 ); // óַ
-                            blk->ldd( t1, t0, vtil::make_imm( 0ull ) );
-                            blk->push( t1 );
-                        } };
-
-        lifter_t nandq{ vm::handler::NANDQ,
-                        []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                        {
-                            auto [ t0, t1 ] = blk->tmp( 64, 64 );
-                            blk->pop( t0 );      // mov     rax, [rbp+0]
-                            blk->pop( t1 );      // mov     rdx, [rbp+8]
-                            blk->bnot( t1 );     // not rdx
-                            blk->bnot( t0 );     // not rax
-                            blk->band( t0, t1 ); // and rax,rdx
-                            blk->push( t0 );
-                            blk->pushf();
-                        } };
-
-        lifter_t nanddw{ vm::handler::NANDDW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                  vmp2::v3::code_block_t *code_blk )
-                         {
-                             auto [ t0, t1 ] = blk->tmp( 32, 32 );
-                             blk->pop( t0 );
-                             blk->pop( t1 );
-                             blk->bnot( t1 );
-                             blk->bnot( t0 );
-                             blk->band( t0, t1 );
-                             blk->push( t0 );
-                             blk->pushf();
-                         } };
-
-        lifter_t nandw{ vm::handler::NANDW,
-                        []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                        {
-                            auto [ t0, t1 ] = blk->tmp( 16, 16 );
-                            blk->pop( t0 );
-                            blk->pop( t1 );
-                            blk->bnot( t1 );
-                            blk->bnot( t0 );
-                            blk->band( t0, t1 );
-                            blk->push( t0 );
-                            blk->pushf();
-                        } };
-
-        lifter_t nandb{ vm::handler::NANDB,
-                        []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                        {
-                            auto [ t0, t1 ] = blk->tmp( 8, 8 );
-                            blk->pop( t0 );
-                            blk->pop( t1 );
-                            blk->bnot( t1 );
-                            blk->bnot( t0 );
-                            blk->band( t0, t1 );
-                            blk->push( t0 );
-                            blk->pushf();
-                        } };
-
-        lifter_t writeq{ vm::handler::WRITEQ, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                  vmp2::v3::code_block_t *code_blk )
-                         {
-                             auto [ t0, t1 ] = blk->tmp( 64, 64 );
-                             blk->pop( t0 );                             // mov     rax, [rbp+0]
-                             blk->pop( t1 );                             // mov     rdx, [rbp+8]
-                             blk->str( t0, vtil::make_imm( 0ull ), t1 ); // mov     [rax], rdx
-                         } };
-
-        lifter_t writew{ vm::handler::WRITEW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                  vmp2::v3::code_block_t *code_blk )
-                         {
-                             auto [ t0, t1 ] = blk->tmp( 64, 16 );
-                             blk->pop( t0 );                             // mov     rax, [rbp+0]
-                             blk->pop( t1 );                             // mov     dx, [rbp+8]
-                             blk->str( t0, vtil::make_imm( 0ull ), t1 ); // mov     [rax], rdx
-                         } };
-
-        lifter_t writedw{ vm::handler::WRITEDW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                    vmp2::v3::code_block_t *code_blk )
-                          {
-                              auto [ t0, t1 ] = blk->tmp( 64, 32 );
-                              blk->pop( t0 );                             // mov     rax, [rbp+0]
-                              blk->pop( t1 );                             // mov     edx, [rbp+8]
-                              blk->str( t0, vtil::make_imm( 0ull ), t1 ); // mov     [rax], rdx
-                          } };
-
-        lifter_t writeb{ vm::handler::WRITEB, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                  vmp2::v3::code_block_t *code_blk )
-                         {
-                             auto [ t0, t1 ] = blk->tmp( 64, 8 );
-                             blk->pop( t0 );
-                             blk->pop( t1 );
-                             blk->str( t0, vtil::make_imm( 0ull ), t1 );
-                         } };
-
-        lifter_t shrq{ vm::handler::SHRQ,
-                       []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                       {
-                           //
-                           auto [ t0, t1 ] = blk->tmp( 64, 64 );
-                           blk->pop( t0 );
-                           blk->pop( t1 );
-                           blk->bshr( t0, t1 );
-                           blk->push( t0 );
-                           blk->pushf();
-                       } };
-
-        lifter_t shrw{ vm::handler::SHRW,
-                       []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                       {
-                           //
-                           auto [ t0, t1 ] = blk->tmp( 16, 16 );
-                           // mov     ax, [rbp+0]
-                           blk->pop( t0 );
-                           // mov     cl, [rbp+2]
-                           blk->pop( t1 );
-                           // shr     ax, cl
-                           blk->bshr( t0, t1 );
-                           blk->push( t0 );
-                           blk->pushf();
-                       } };
-
-        lifter_t shrb{ vm::handler::SHRB,
-                       []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                       {
-                           //
-                           auto [ t0, t1 ] = blk->tmp( 8, 8 );
-                           blk->pop( t0 );
-                           blk->pop( t1 );
-                           blk->bshr( t0, t1 );
-                           blk->push( t0 );
-                           blk->pushf();
-                       } };
-
-        lifter_t shlb{ vm::handler::SHLB,
-                       []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                       {
-                           //
-                           auto [ t0, t1 ] = blk->tmp( 8, 8 );
-                           blk->pop( t0 );
-                           blk->pop( t1 );
-                           blk->bshr( t0, t1 );
-                           blk->push( t0 );
-                           blk->pushf();
-                       } };
-
-        lifter_t shldw{ vm::handler::SHLDW,
-                        []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                        {
-                            //
-                            auto [ t0, t1 ] = blk->tmp( 32, 32 );
-                            blk->pop( t0 );
-                            blk->pop( t1 );
-                            blk->bshr( t0, t1 );
-                            blk->push( t0 );
-                            blk->pushf();
-                        } };
-
-        lifter_t shlq{ vm::handler::SHLQ,
-                       []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                       {
-                           //
-                           auto [ t0, t1 ] = blk->tmp( 64, 64 );
-                           blk->pop( t0 );
-                           blk->pop( t1 );
-                           blk->bshr( t0, t1 );
-                           blk->push( t0 );
-                           blk->pushf();
-                       } };
-
-        lifter_t pushvspq{ vm::handler::PUSHVSPQ,
-                           []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                               vmp2::v3::code_block_t *code_blk ) { blk->push( vtil::REG_SP ); } };
-
-        lifter_t popvspq{ vm::handler::POPVSPQ, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                    vmp2::v3::code_block_t *code_blk ) { blk->pop( vtil::REG_SP ); } };
-
-        lifter_t lflagsq{ vm::handler::LFLAGSQ, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                    vmp2::v3::code_block_t *code_blk ) { blk->popf(); } };
-
-        lifter_t rdtsc{ vm::handler::RDTSC,
-                        []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                        {
-                            blk->vemits( "rdtsc" )
-                                ->vpinw( X86_REG_RDX )
-                                ->vpinw( X86_REG_RAX )
-
-                                // [rsp + 4] := edx
-                                // [rsp] := eax
-                                ->push( X86_REG_EAX )
-                                ->push( X86_REG_EDX );
-                        } };
-
-        lifter_t divw{ vm::handler::DIVW,
-                       []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                       {
-                           auto [ a0, a1, d, c ] = blk->tmp( 16, 16, 16, 16 );
-                           blk
-                               // t0 := [rsp]
-                               // t1 := [rsp+*]
-                               // t2 := [rsp+2*]
-                               ->pop( d )  // d
-                               ->pop( a0 ) // a
-                               ->pop( c )  // c
-                               ->mov( a1, a0 )
-
-                               // div
-                               ->div( a0, d, c )
-                               ->rem( a1, d, c )
-
-                               // [rsp] := flags
-                               // [rsp+8] := t0
-                               // [rsp+8+*] := t1
-                               ->push( a0 )
-                               ->push( a1 )
-                               ->pushf();
-                       } };
-
-        lifter_t mulw{ vm::handler::MULW,
-                       []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
-                       {
-                           auto [ a0, a1, d ] = blk->tmp( 16, 16, 16 );
-
-                           blk
-                               // t0 := [rsp]
-                               // t1 := [rsp+*]
-                               ->pop( d )  // d
-                               ->pop( a0 ) // a
-                               ->mov( a1, a0 )
-
-                               // mul
-                               ->mul( a0, d )
-                               ->mulhi( a1, d )
-                               //->upflg( vtil::REG_FLAGS ) TODO
-
-                               // [rsp] := flags
-                               // [rsp+8] := t0
-                               // [rsp+8+*] := t1
-                               ->push( a0 )
-                               ->push( a1 )
-                               ->pushf();
-                       } };
-
-        lifter_t shlddw = { vm::handler::SHLDDW, []( vtil::basic_block *blk, vm::instrs::virt_instr_t *vinstr,
-                                                     vmp2::v3::code_block_t *code_blk )
-                            {
-                                auto [ t0, t1, t2, t3 ] = blk->tmp( 32, 32, 32, 32 );
-
-                                blk
-                                    // t0 := [rsp]
-                                    // t1 := [rsp+*]
-                                    // t2 := [rsp+2*]
-                                    ->pop( t0 )
-                                    ->pop( t1 )
-                                    ->pop( t2 )
-
-                                    // t0 := t0 >> t2
-                                    ->bshl( t0, t2 )
-
-                                    // t3 := v[0]*8
-                                    // t3 -= t2
-                                    ->mov( t3, vtil::make_imm< uint8_t >( 32 ) )
-                                    ->sub( t3, t2 )
-
-                                    // t1 := t1 << t3
-                                    ->bshr( t1, t3 )
-
-                                    // t0 |= t1
-                                    ->bor( t0, t1 )
-                                    //->upflg( vtil::REG_FLAGS ) TODO
-
-                                    // [rsp+8] := t0
-                                    ->push( t0 )
-                                    ->pushf();
-                            } };
-
-        lifter_t LiftersArray[] = {
-            lconstbzxq, lconstq, lconstdw, lconstbzxw, lconstwsxq, lconstw, lconstb2w, sregq,    sregw,   sregdw, sregb,
-            addq,       adddw,   addw,     addb,       lregq,      lregdw,  lregw,     pushvspq, popvspq, readq,  readw,
-            readdw,     readb,   writeq,   writedw,    writew,     writeb,  nandq,     nanddw,   nandw,   nandb,  shrq,
-            shrw,       shrb,    shlq,     shldw,      shlb,       shlddw,  lflagsq,   rdtsc,    divw,    mulw,
+                const auto result = vtil::operand( ~( *lhs | *rhs ) & width_mask< N >(), N );
+                ctx->drop()->drop();
+                ctx->record_flags( flags_op_t::logic, result );
+                ctx->push( result )->pushf();
+                return;
+            }
+
+            auto [ t0, t1 ] = ctx->blk->tmp( N, N );
+            ctx->pop( t0 );           // mov     rax, [rbp+0]
+            ctx->pop( t1 );           // mov     rdx, [rbp+8]
+            ctx->blk->bnot( t1 );     // not rdx
+            ctx->blk->bnot( t0 );     // not rax
+            ctx->blk->band( t0, t1 ); // and rax,rdx
+            ctx->record_flags( flags_op_t::logic, t0 );
+            ctx->push( t0 );
+            ctx->pushf();
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_read( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto value = ctx->blk->tmp( N );
+            const auto [ base, offset ] = ctx->pop_address();
+            ctx->blk->ldd( value, base, vtil::make_imm( offset ) );
+            ctx->push( value );
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_write( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto value = ctx->blk->tmp( N );
+            const auto [ base, offset ] = ctx->pop_address();      // mov     rax, [rbp+0]
+            ctx->pop( value );                                     // mov     dx, [rbp+8]
+            ctx->blk->str( base, vtil::make_imm( offset ), value ); // mov     [rax], rdx
+        }
+
+        // the native shifts mask the count to 5 bits, 6 for 64 bit operands. counts of N or more that survive the
+        // mask clear 8 and 16 bit operands, which is what bshr/bshl do for them
+        template < vtil::bitcnt_t N > constexpr std::uint64_t shift_count_mask = N == 64 ? 63 : 31;
+
+        // shr/shl of a constant by a constant
+        template < vtil::bitcnt_t N, bool Left > bool fold_shift( lift_context_t *ctx )
+        {
+            const auto value = ctx->constant( N, 0 ), count = ctx->constant( N, 1 );
+            if ( !value || !count )
+                return false;
+
+            const auto shift = *count & shift_count_mask< N >;
+            const auto folded = shift >= N ? 0 : ( Left ? *value << shift : *value >> shift ) & width_mask< N >();
+            const auto result = vtil::operand( folded, N );
+
+            ctx->drop()->drop();
+            ctx->record_flags( shift ? flags_op_t::shift : flags_op_t::none, result, vtil::operand( shift, N ) );
+            ctx->push( result )->pushf();
+            return true;
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_shr( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            if ( fold_shift< N, false >( ctx ) )
+                return;
+
+            auto [ t0, t1 ] = ctx->blk->tmp( N, N );
+            // mov     ax, [rbp+0]
+            ctx->pop( t0 );
+            // mov     cl, [rbp+2]
+            ctx->pop( t1 );
+            // shr     ax, cl
+            ctx->blk->band( t1, vtil::operand( shift_count_mask< N >, N ) )->bshr( t0, t1 );
+            ctx->record_flags( flags_op_t::shift, t0, t1 );
+            ctx->push( t0 );
+            ctx->pushf();
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_shl( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            if ( fold_shift< N, true >( ctx ) )
+                return;
+
+            auto [ t0, t1 ] = ctx->blk->tmp( N, N );
+            ctx->pop( t0 );
+            ctx->pop( t1 );
+            // shl     ax, cl
+            ctx->blk->band( t1, vtil::operand( shift_count_mask< N >, N ) )->bshl( t0, t1 );
+            ctx->record_flags( flags_op_t::shift, t0, t1 );
+            ctx->push( t0 );
+            ctx->pushf();
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_shld( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto [ t0, t1, t2, t3 ] = ctx->blk->tmp( N, N, N, N );
+
+            // t0 := [rsp]
+            // t1 := [rsp+*]
+            // t2 := [rsp+2*]
+            ctx->pop( t0 )->pop( t1 )->pop( t2 );
+
+            ctx->blk
+                // t2 &= shift_count_mask< N > (63 for 64 bit operands, 31 otherwise)
+                ->band( t2, vtil::operand( shift_count_mask< N >, N ) )
+
+                // t0 := t0 << t2
+                ->bshl( t0, t2 )
+
+                // t3 := N
+                // t3 -= t2
+                ->mov( t3, vtil::make_imm< uint8_t >( N ) )
+                ->sub( t3, t2 )
+
+                // t1 := t1 >> t3
+                ->bshr( t1, t3 )
+
+                // t0 |= t1
+                ->bor( t0, t1 );
+
+            // [rsp+8] := t0
+            ctx->record_flags( flags_op_t::shift, t0, t2 );
+            ctx->push( t0 )->pushf();
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_shrd( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto [ t0, t1, t2, t3 ] = ctx->blk->tmp( N, N, N, N );
+
+            // t0 := [rsp]
+            // t1 := [rsp+*]
+            // t2 := [rsp+2*]
+            ctx->pop( t0 )->pop( t1 )->pop( t2 );
+
+            ctx->blk
+                // t2 &= shift_count_mask< N > (63 for 64 bit operands, 31 otherwise)
+                ->band( t2, vtil::operand( shift_count_mask< N >, N ) )
+
+                // t0 := t0 >> t2
+                ->bshr( t0, t2 )
+
+                // t3 := N
+                // t3 -= t2
+                ->mov( t3, vtil::make_imm< uint8_t >( N ) )
+                ->sub( t3, t2 )
+
+                // t1 := t1 << t3
+                ->bshl( t1, t3 )
+
+                // t0 |= t1
+                ->bor( t0, t1 );
+
+            // [rsp+8] := t0
+            ctx->record_flags( flags_op_t::shift, t0, t2 );
+            ctx->push( t0 )->pushf();
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_div( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto [ a0, a1, d, c ] = ctx->blk->tmp( N, N, N, N );
+
+            // t0 := [rsp]
+            // t1 := [rsp+*]
+            // t2 := [rsp+2*]
+            ctx->pop( d )   // d
+                ->pop( a0 ) // a
+                ->pop( c ); // c
+
+            ctx->blk
+                ->mov( a1, a0 )
+
+                // div
+                ->div( a0, d, c )
+                ->rem( a1, d, c );
+
+            // [rsp] := flags
+            // [rsp+8] := t0
+            // [rsp+8+*] := t1
+            ctx->push( a0 )->push( a1 )->pushf();
+        }
+
+        template < vtil::bitcnt_t N >
+        void lift_mul( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            auto [ a0, a1, d ] = ctx->blk->tmp( N, N, N );
+
+            // t0 := [rsp]
+            // t1 := [rsp+*]
+            ctx->pop( d )    // d
+                ->pop( a0 ); // a
+
+            ctx->blk
+                ->mov( a1, a0 )
+
+                // mul
+                ->mul( a0, d )
+                ->mulhi( a1, d );
+            ctx->record_flags( flags_op_t::mul, a0, a1 );
+
+            // [rsp] := flags
+            // [rsp+8] := t0
+            // [rsp+8+*] := t1
+            ctx->push( a0 )->push( a1 )->pushf();
+        }
+
+        constexpr lifter_t lconstbzxq = { vm::handler::LCONSTBSXQ, &lift_lconst_extend< 64, 8, true > };
+        constexpr lifter_t lconstq = { vm::handler::LCONSTQ, &lift_lconst< 64 > };
+        constexpr lifter_t lconstdw = { vm::handler::LCONSTDW, &lift_lconst< 32 > };
+        constexpr lifter_t lconstw = { vm::handler::LCONSTW, &lift_lconst< 16 > };
+        constexpr lifter_t lconstb2w = { vm::handler::LCONSTB2W, &lift_lconst_extend< 16, 8, true > };
+        constexpr lifter_t lconstbzxw = { vm::handler::LCONSTBZXW, &lift_lconst_extend< 16, 8, false > };
+        constexpr lifter_t lconstwsxq = { vm::handler::LCONSTWSXQ, &lift_lconst_extend< 64, 16, true > };
+
+        constexpr lifter_t sregq = { vm::handler::SREGQ, &lift_sreg< 64 > };
+        constexpr lifter_t sregdw = { vm::handler::SREGDW, &lift_sreg< 32 > };
+        constexpr lifter_t sregw = { vm::handler::SREGW, &lift_sreg< 16 > };
+        constexpr lifter_t sregb = { vm::handler::SREGB, &lift_sreg< 8 > };
+
+        constexpr lifter_t lregq = { vm::handler::LREGQ, &lift_lreg< 64 > };
+        constexpr lifter_t lregdw = { vm::handler::LREGDW, &lift_lreg< 32 > };
+        constexpr lifter_t lregw = { vm::handler::LREGW, &lift_lreg< 16 > };
+        constexpr lifter_t lregb = { vm::handler::LREGB, &lift_lreg< 8 > };
+
+        constexpr lifter_t addq = { vm::handler::ADDQ, &lift_add< 64 > };
+        constexpr lifter_t adddw = { vm::handler::ADDDW, &lift_add< 32 > };
+        constexpr lifter_t addw = { vm::handler::ADDW, &lift_add< 16 > };
+        constexpr lifter_t addb = { vm::handler::ADDB, &lift_add< 8 > };
+
+        constexpr lifter_t nandq = { vm::handler::NANDQ, &lift_nand< 64 > };
+        constexpr lifter_t nanddw = { vm::handler::NANDDW, &lift_nand< 32 > };
+        constexpr lifter_t nandw = { vm::handler::NANDW, &lift_nand< 16 > };
+        constexpr lifter_t nandb = { vm::handler::NANDB, &lift_nand< 8 > };
+
+        constexpr lifter_t readq = { vm::handler::READQ, &lift_read< 64 > };
+        constexpr lifter_t readdw = { vm::handler::READDW, &lift_read< 32 > };
+        constexpr lifter_t readw = { vm::handler::READW, &lift_read< 16 > };
+        constexpr lifter_t readb = { vm::handler::READB, &lift_read< 8 > };
+
+        constexpr lifter_t writeq = { vm::handler::WRITEQ, &lift_write< 64 > };
+        constexpr lifter_t writedw = { vm::handler::WRITEDW, &lift_write< 32 > };
+        constexpr lifter_t writew = { vm::handler::WRITEW, &lift_write< 16 > };
+        constexpr lifter_t writeb = { vm::handler::WRITEB, &lift_write< 8 > };
+
+        constexpr lifter_t shrq = { vm::handler::SHRQ, &lift_shr< 64 > };
+        constexpr lifter_t shrdw = { vm::handler::SHRDW, &lift_shr< 32 > };
+        constexpr lifter_t shrw = { vm::handler::SHRW, &lift_shr< 16 > };
+        constexpr lifter_t shrb = { vm::handler::SHRB, &lift_shr< 8 > };
+
+        constexpr lifter_t shlq = { vm::handler::SHLQ, &lift_shl< 64 > };
+        constexpr lifter_t shldw = { vm::handler::SHLDW, &lift_shl< 32 > };
+        constexpr lifter_t shlw = { vm::handler::SHLW, &lift_shl< 16 > };
+        constexpr lifter_t shlb = { vm::handler::SHLB, &lift_shl< 8 > };
+
+        constexpr lifter_t shlddw = { vm::handler::SHLDDW, &lift_shld< 32 > };
+        constexpr lifter_t shrddw = { vm::handler::SHRDDW, &lift_shrd< 32 > };
+
+        constexpr lifter_t divq = { vm::handler::DIVQ, &lift_div< 64 > };
+        constexpr lifter_t divdw = { vm::handler::DIVDW, &lift_div< 32 > };
+        constexpr lifter_t divw = { vm::handler::DIVW, &lift_div< 16 > };
+
+        constexpr lifter_t mulq = { vm::handler::MULQ, &lift_mul< 64 > };
+        constexpr lifter_t muldw = { vm::handler::MULDW, &lift_mul< 32 > };
+        constexpr lifter_t mulw = { vm::handler::MULW, &lift_mul< 16 > };
+
+        // pushing or popping $sp flushes the values held in temporaries first, see lift_context_t
+        constexpr lifter_t pushvspq{ vm::handler::PUSHVSPQ,
+                                     []( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                         vmp2::v3::code_block_t *code_blk ) { ctx->push( vtil::REG_SP ); } };
+
+        constexpr lifter_t popvspq{ vm::handler::POPVSPQ,
+                                    []( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                        vmp2::v3::code_block_t *code_blk ) { ctx->pop( vtil::REG_SP ); } };
+
+        constexpr lifter_t lflagsq{ vm::handler::LFLAGSQ,
+                                    []( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr,
+                                        vmp2::v3::code_block_t *code_blk ) { ctx->popf(); } };
+
+        constexpr lifter_t rdtsc{ vm::handler::RDTSC,
+                                  []( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+                                  {
+                                      ctx->blk->vemits( "rdtsc" )->vpinw( X86_REG_RDX )->vpinw( X86_REG_RAX );
+
+                                      // [rsp + 4] := edx
+                                      // [rsp] := eax
+                                      ctx->push( X86_REG_EAX )->push( X86_REG_EDX );
+                                  } };
+
+        // bump whenever lift_context_t, the idioms or the driver change what they emit, cached blocks are keyed on it
+        constexpr std::uint32_t LiftersVersion = 2;
+
+        // version of the lifter of every family, indexed by family_t. bump the entry of a family when its lifter
+        // changes what it emits, only the blocks that use it are keyed differently and lifted again
+        constexpr std::uint32_t LifterVersions[] = {
+            1, // invalid
+            2, // lconst
+            1, // sreg
+            1, // lreg
+            1, // add
+            1, // nand
+            1, // read
+            1, // write
+            2, // shr
+            2, // shl
+            2, // shld
+            2, // shrd
+            1, // div
+            1, // mul
+            1, // pushvsp
+            1, // popvsp
+            1, // lflags
+            1, // rdtsc
+        };
+
+        // combines the versions of the families in the mask, see used_families
+        constexpr std::uint64_t lifter_versions( std::uint64_t families )
+        {
+            std::uint64_t hash = 0xcbf29ce484222325ull;
+            for ( auto family = 0u; family < std::size( LifterVersions ); ++family )
+                if ( families & ( 1ull << family ) )
+                    hash = ( hash ^ ( ( std::uint64_t )family << 32 | LifterVersions[ family ] ) ) * 0x100000001b3ull;
+            return hash;
+        }
+
+        constexpr lifter_t LiftersArray[] = {
+            lconstbzxq, lconstq, lconstdw, lconstbzxw, lconstwsxq, lconstw, lconstb2w, sregq,  sregw,  sregdw,   sregb,
+            addq,       adddw,   addw,     addb,       lregq,      lregdw,  lregw,     lregb,  pushvspq, popvspq, readq,
+            readw,      readdw,  readb,    writeq,     writedw,    writew,  writeb,    nandq,  nanddw, nandw,    nandb,
+            shrq,       shrdw,   shrw,     shrb,       shlq,       shldw,   shlw,      shlb,   shlddw, shrddw,   lflagsq,
+            rdtsc,      divq,    divdw,    divw,       mulq,       muldw,   mulw,
         };
 
+        // LiftersTable[ mnemonic ] -> lifter, built at compile time so the driver never has to scan LiftersArray
+        constexpr std::size_t LiftersTableSize = []
+        {
+            std::size_t max_mnemonic = 0;
+            for ( const auto &lifter : LiftersArray )
+                max_mnemonic = std::max< std::size_t >( max_mnemonic, lifter.mnemonic );
+            return max_mnemonic + 1;
+        }();
+
+        constexpr std::array< lift_fn_t, LiftersTableSize > LiftersTable = []
+        {
+            std::array< lift_fn_t, LiftersTableSize > table{};
+            for ( const auto &lifter : LiftersArray )
+                table[ lifter.mnemonic ] = lifter.func;
+            return table;
+        }();
+
+        inline lift_fn_t get_lifter( vm::handler::mnemonic_t mnemonic )
+        {
+            const auto idx = static_cast< std::size_t >( mnemonic );
+            return idx < LiftersTable.size() ? LiftersTable[ idx ] : nullptr;
+        }
+
+        // lifts an idiom found by match_idiom in place of the handlers it is made of
+        inline void lift_idiom( lift_context_t *ctx, const idiom_match_t &idiom )
+        {
+            const auto bits = idiom.bits;
+            const auto load = [ & ]( const idiom_source_t &source ) -> vtil::operand
+            {
+                if ( source.is_imm )
+                    return vtil::operand( source.value & width_mask( bits ), bits );
+
+                auto value = ctx->blk->tmp( bits );
+                ctx->blk->mov( value, ctx->context_register( source.value, bits / 8 ) );
+                return value;
+            };
+
+            const auto a = load( idiom.a );
+            const auto b = idiom.kind == idiom_t::not_ ? a : load( idiom.b );
+
+            // the scratch registers still receive the intermediate flags like they would from the handlers
+            for ( auto store = 0u; store < idiom.flag_store_count; ++store )
+            {
+                ctx->vinstr_index = idiom.flag_stores[ store ].producer;
+                ctx->pushf()->pop( ctx->context_register( idiom.flag_stores[ store ].context_offset, 8 ) );
+            }
+
+            auto result = ctx->blk->tmp( bits );
+            ctx->blk->mov( result, a );
+
+            switch ( idiom.kind )
+            {
+            case idiom_t::not_:
+                ctx->blk->bnot( result );
+                break;
+            case idiom_t::and_:
+                ctx->blk->band( result, b );
+                break;
+            case idiom_t::or_:
+                ctx->blk->bor( result, b );
+                break;
+            case idiom_t::xor_:
+                ctx->blk->bxor( result, b );
+                break;
+            case idiom_t::sub:
+                ctx->blk->sub( result, b );
+                break;
+            default:
+                break;
+            }
+
+            // the last handler of every idiom is a nand, its flags describe the result
+            ctx->vinstr_index = idiom.index + idiom.length - 1;
+            ctx->record_flags( flags_op_t::logic, result );
+            ctx->push( result )->pushf();
+        }
+
+        // returns false if there is no lifter for the virtual instruction
+        inline bool lift( lift_context_t *ctx, vm::instrs::virt_instr_t *vinstr, vmp2::v3::code_block_t *code_blk )
+        {
+            const auto func = get_lifter( vinstr->mnemonic_t );
+            if ( !func )
+            {
+#ifdef LIFTERS_INSTRUMENTATION
+                instrumentation::profiler_t::get().record_missing( vinstr->mnemonic_t );
+#endif
+                return false;
+            }
+
+#ifdef LIFTERS_INSTRUMENTATION
+            instrumentation::handler_timer_t timer( vinstr->mnemonic_t, ctx->blk->size() );
+#endif
+            func( ctx, vinstr, code_blk );
+#ifdef LIFTERS_INSTRUMENTATION
+            timer.stop( ctx->blk->size() );
+#endif
+            return true;
+        }
+
+        // lifts every virtual instruction of the code block, stops at the first instruction without a lifter.
+        // values still held in temporaries are written to the stack before returning
+        inline bool lift( lift_context_t *ctx, vmp2::v3::code_block_t *code_blk )
+        {
+            LIFTERS_SPAN( "lift_block", "lift", code_blk->vip_begin );
+#ifdef LIFTERS_INSTRUMENTATION
+            instrumentation::block_recorder_t< vtil::basic_block > recorder( ctx->blk, code_blk->vinstr_count );
+#endif
+            ctx->begin_block( code_blk );
+
+            for ( auto idx = 0u; idx < code_blk->vinstr_count; ++idx )
+            {
+                if ( ctx->options.recognize_idioms )
+                {
+                    const auto idiom = match_idiom( code_blk, idx );
+
+                    // lazy flags would have to compute the intermediate flags of the idiom if they were read
+                    bool flags_dead = true;
+                    for ( auto store = 0u; store < idiom.flag_store_count; ++store )
+                        if ( ctx->options.lazy_flags && ctx->is_flags_live( idiom.flag_stores[ store ].producer ) )
+                            flags_dead = false;
+
+                    if ( idiom.kind != idiom_t::none && flags_dead )
+                    {
+#ifdef LIFTERS_INSTRUMENTATION
+                        instrumentation::idiom_timer_t timer( ctx->blk->size() );
+                        lift_idiom( ctx, idiom );
+                        timer.stop( code_blk, idiom.index, idiom.length, ctx->blk->size() );
+#else
+                        lift_idiom( ctx, idiom );
+#endif
+                        idx = idiom.index + idiom.length - 1;
+                        continue;
+                    }
+                }
+
+                ctx->vinstr_index = idx;
+                if ( !lift( ctx, &code_blk->vinstr[ idx ], code_blk ) )
+                {
+                    ctx->flush();
+                    return false;
+                }
+            }
+
+            ctx->flush();
+            return true;
+        }
+
+        inline bool lift( vtil::basic_block *blk, vmp2::v3::code_block_t *code_blk, lift_options_t options = {} )
+        {
+            lift_context_t ctx( blk, options );
+            return lift( &ctx, code_blk );
+        }
+
     }; // namespace lifter_vtil
 } // namespace lifters
\ No newline at end of file